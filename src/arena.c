@@ -0,0 +1,138 @@
+/* Copyright lynix <lynix47@gmail.com>, 2009, 2010, 2014
+ *
+ * This file is part of vcp (verbose cp).
+ *
+ * vcp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcp. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* alignment of all allocations, enough for pointers and off_t */
+#define ARENA_ALIGN 8
+
+typedef struct chunk {
+    struct chunk    *next;
+    size_t          size;
+    size_t          used;
+    char            *data;
+} chunk_t;
+
+/* chunks are kept in a singly-linked list, the first one is filled */
+struct arena {
+    chunk_t *head;
+};
+
+
+static chunk_t *chunk_new(size_t size)
+{
+    chunk_t *chunk = malloc(sizeof(chunk_t) + size);
+    if (chunk == NULL)
+        return NULL;
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    chunk->data = (char *)(chunk + 1);
+
+    return chunk;
+}
+
+arena_t *arena_new()
+{
+    arena_t *arena = malloc(sizeof(arena_t));
+    if (arena == NULL)
+        return NULL;
+
+    arena->head = NULL;
+
+    return arena;
+}
+
+void arena_delete(arena_t *arena)
+{
+    chunk_t *chunk = arena->head;
+
+    while (chunk != NULL) {
+        chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    free(arena);
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    chunk_t *chunk = arena->head;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (chunk != NULL && chunk->size - chunk->used >= size) {
+        void *ptr = chunk->data + chunk->used;
+        chunk->used += size;
+        return ptr;
+    }
+
+    /* large blocks get a chunk of their own behind the current one, so
+     * that the latter keeps being filled */
+    if (chunk != NULL && size > ARENA_CHUNK / 4) {
+        chunk_t *large = chunk_new(size);
+        if (large == NULL)
+            return NULL;
+        large->used = size;
+        large->next = chunk->next;
+        chunk->next = large;
+        return large->data;
+    }
+
+    chunk = chunk_new(size > ARENA_CHUNK ? size : ARENA_CHUNK);
+    if (chunk == NULL)
+        return NULL;
+    chunk->used = size;
+    chunk->next = arena->head;
+    arena->head = chunk;
+
+    return chunk->data;
+}
+
+char *arena_strdup(arena_t *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(arena, len);
+
+    if (copy != NULL)
+        memcpy(copy, str, len);
+
+    return copy;
+}
+
+void arena_merge(arena_t *into, arena_t *from)
+{
+    if (from->head == NULL)
+        return;
+
+    /* append behind the first chunk, which keeps being filled */
+    chunk_t *last = from->head;
+    while (last->next != NULL)
+        last = last->next;
+    if (into->head == NULL) {
+        into->head = from->head;
+    } else {
+        last->next = into->head->next;
+        into->head->next = from->head;
+    }
+    from->head = NULL;
+}
@@ -0,0 +1,45 @@
+/* Copyright lynix <lynix47@gmail.com>, 2009, 2010, 2014
+ *
+ * This file is part of vcp (verbose cp).
+ *
+ * vcp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcp. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>                     // size_t
+
+#define ARENA_CHUNK 1048576 /* allocate arena memory in 1MiB chunks    */
+
+typedef struct arena arena_t;
+
+
+// create new, empty arena
+arena_t *arena_new();
+
+// free all memory allocated from given arena, and the arena itself
+void    arena_delete(arena_t *arena);
+
+// allocate given number of bytes from given arena (suitably aligned for
+// any struct), returns NULL if out of memory; not thread-safe
+void    *arena_alloc(arena_t *arena, size_t size);
+
+// copy given string into given arena
+char    *arena_strdup(arena_t *arena, const char *str);
+
+// move all memory of arena 'from' to arena 'into', leaving 'from' empty
+void    arena_merge(arena_t *into, arena_t *from);
+
+#endif
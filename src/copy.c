@@ -16,135 +16,1552 @@
  * along with vcp. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE         /* copy_file_range()                        */
+
 #include "copy.h"
 #include "helpers.h"
+#include "zero.h"
+#include "journal.h"
+#include "hash.h"
 
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>       /* FICLONE, FICLONERANGE                    */
+
+/* return values of the copy engines */
+#define ENGINE_OK       0   /* data copied completely                   */
+#define ENGINE_FAIL     -1  /* I/O error, already added to fail-list    */
+#define ENGINE_UNSUPP   1   /* engine unavailable here, try next one    */
+
+/* state of a single file transfer */
+typedef struct {
+    file_t  *file;
+    int     src;
+    int     dst;
+    off_t   dst_size;                   /* kept for update, or 0    */
+    char    in_place;                   /* dst kept on failure      */
+    char    src_path[PATH_MAX];
+    char    dst_path[PATH_MAX];
+    off_t   done;
+    char    src_direct;                 /* opened with O_DIRECT     */
+    char    dst_direct;
+    char    nocache;                    /* drop copied pages        */
+    off_t   window;                     /* start of current window  */
+    off_t   window_prev;                /* start of previous window */
+    size_t  zero_block;                 /* skip zero blocks, or 0   */
+    journal_t *journal;                 /* commit progress, or NULL */
+    off_t   committed;                  /* synced part of dst       */
+    char    summing;                    /* hash data passing by     */
+    xxh64_t sum;
+    buffer_t *buffer;                   /* I/O buffer of the worker */
+    size_t  chunk;                      /* current I/O size         */
+    int     tune_dir;                   /* grow, shrink or keep (0) */
+    size_t  tune_first;                 /* chunk size tuning began  */
+    size_t  tune_best;                  /* fastest chunk size yet   */
+    double  tune_rate;                  /* its throughput (B/s)     */
+    off_t   tune_done;                  /* start of current sample  */
+    struct timespec tune_time;
+} copy_t;
+
+/* shared state of a file split into concurrently copied ranges */
+typedef struct {
+    copy_t          *copy;
+    strlist_t       *fail_list;
+    off_t           next;
+    char            failed;
+    pthread_mutex_t lock;
+} split_t;
+
+/* single-producer/single-consumer ring of buffers: each side owns its
+ * index, slots are handed over by semaphores without taking any lock */
+typedef struct {
+    char            *buffers;
+    size_t          buff_size;
+    ssize_t         fill[PIPE_DEPTH];   /* 0: EOF, -1: read error   */
+    unsigned int    head;               /* written by reader only   */
+    unsigned int    tail;               /* written by writer only   */
+    sem_t           filled;
+    sem_t           empty;
+    int             src;
+    int             error;
+    char            abort;
+} pipe_t;
+
+/* optimal I/O sizes of block devices, read from sysfs once per device */
+#define DEV_CACHE 16
+static struct {
+    dev_t   dev;
+    size_t  io_size;
+} dev_cache[DEV_CACHE];
+static unsigned int     dev_cached;
+static pthread_mutex_t  dev_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* inter-thread globals */
 char            progress_alive;
+char            progress_shared;
+pthread_t       progress_tid;
 pthread_mutex_t progress_lock;
 size_t          progress_bytes;
 opts_t          *options;
 flist_t         *file_list;
 
 
-int copy_file(file_t *file, flist_t *flist, strlist_t *fail_list, opts_t *opts,
-              char *buffer, unsigned int buff_size)
+/* page cache hints when a window of data has been transferred */
+static void copy_window(copy_t *copy)
 {
-    /* open files */
-    FILE *src = fopen(file->src, "r");
-    FILE *dst = fopen(file->dst, "w");
-    if (src == NULL) {
-        fail_append(fail_list, file->src, "unable to open for reading");
-        return -1;
+    off_t start = copy->window;
+
+    /* keep read-ahead one window in front */
+    if (!copy->src_direct)
+        posix_fadvise(copy->src, copy->done, CACHE_WINDOW,
+                      POSIX_FADV_WILLNEED);
+
+    if (copy->nocache) {
+        /* start writeback of this window, drop the previous one, which
+         * should be on disk by now: dirty pages cannot be dropped */
+        sync_file_range(copy->dst, start, copy->done - start,
+                        SYNC_FILE_RANGE_WRITE);
+        if (start > copy->window_prev) {
+            off_t len = start - copy->window_prev;
+            sync_file_range(copy->dst, copy->window_prev, len,
+                            SYNC_FILE_RANGE_WAIT_BEFORE |
+                            SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(copy->dst, copy->window_prev, len,
+                          POSIX_FADV_DONTNEED);
+            posix_fadvise(copy->src, copy->window_prev, len,
+                          POSIX_FADV_DONTNEED);
+        }
+        copy->window_prev = start;
     }
-    if (dst == NULL) {
-        fail_append(fail_list, file->dst, "unable to open for writing");
-        return -1;
+
+    copy->window = copy->done;
+}
+
+/* chunk size feedback: measure throughput of the last sample, keep
+ * doubling (or halving) the chunk size as long as that pays off */
+static void copy_tune(copy_t *copy)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double secs = (now.tv_sec - copy->tune_time.tv_sec) +
+                  (now.tv_nsec - copy->tune_time.tv_nsec) / 1e9;
+    double rate = (copy->done - copy->tune_done) / secs;
+    copy->tune_done = copy->done;
+    copy->tune_time = now;
+    if (secs <= 0)
+        return;
+    print_debug("chunk size %zu: %.1f MiB/s", copy->chunk, rate / 1048576);
+
+    /* demand 5% gain, anything less may be noise */
+    if (rate > copy->tune_rate * 1.05) {
+        copy->tune_rate = rate;
+        copy->tune_best = copy->chunk;
+    } else {
+        /* growing did not help right away: try shrinking once */
+        copy->tune_dir = (copy->tune_dir > 0 &&
+                          copy->tune_best == copy->tune_first) ? -1 : 0;
+        copy->chunk = copy->tune_best;
     }
 
-    /* initialize stats, spawn progress thread if reasonable */
-    size_t n_read, n_writt;
-    pthread_t prg_thread;
-    progress_alive = 0;
-    if (!opts->quiet && file->size > BUFFS * BUFFM) {
-        if (pthread_mutex_init(&progress_lock, NULL) != 0) {
-            fail_append(fail_list, file->dst, "failed to initialize mutex");
+    size_t next = (copy->tune_dir > 0) ? copy->chunk * 2 : copy->chunk / 2;
+    if (copy->tune_dir == 0 || next < BUFF_MIN || next > BUFF_MAX) {
+        copy->tune_dir = 0;
+        return;
+    }
+    copy->chunk = next;
+}
+
+/* make the data written so far durable, so that an interrupted run can
+ * continue from here (see --resume) */
+static void copy_commit(copy_t *copy)
+{
+    if (fdatasync(copy->dst) == 0)
+        journal_partial(copy->journal, copy->dst_path, copy->file,
+                        copy->done);
+    copy->committed = copy->done;
+}
+
+/* account for transferred bytes, feed progress thread */
+static void copy_advance(copy_t *copy, size_t bytes)
+{
+    copy->done += bytes;
+    if (copy->done - copy->window >= CACHE_WINDOW)
+        copy_window(copy);
+    if (copy->tune_dir != 0 && copy->done - copy->tune_done >= TUNE_WINDOW)
+        copy_tune(copy);
+    if (copy->journal != NULL && copy->done - copy->committed >=
+            JOURNAL_COMMIT)
+        copy_commit(copy);
+
+    if (progress_alive) {
+        pthread_mutex_lock(&progress_lock);
+        progress_bytes += bytes;
+        pthread_mutex_unlock(&progress_lock);
+    }
+}
+
+/* feed given data into the checksum of the transfer (--checksum) */
+static void copy_sum(copy_t *copy, char *buffer, size_t count)
+{
+    if (copy->summing)
+        xxh64_update(&copy->sum, buffer, count);
+}
+
+/* errors telling that an engine is not supported for this pair of files */
+static int engine_unsupported(int error)
+{
+    return error == ENOSYS || error == EXDEV || error == EINVAL ||
+           error == EOPNOTSUPP || error == ENOTTY;
+}
+
+/* write given buffer completely, retry on short writes */
+static int write_all(int fd, char *buffer, size_t count)
+{
+    ssize_t n;
+
+    while (count > 0) {
+        n = write(fd, buffer, count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
             return -1;
+        buffer += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+/* share data extents with source (btrfs, XFS), no data is moved at all */
+static int copy_clone(copy_t *copy, strlist_t *fail_list, opts_t *opts)
+{
+    int ret;
+
+    if (copy->done == 0) {
+        ret = ioctl(copy->dst, FICLONE, copy->src);
+    } else {
+        /* partially transferred: clone remainder, offsets must be aligned */
+        struct file_clone_range range;
+        range.src_fd        = copy->src;
+        range.src_offset    = copy->done;
+        range.src_length    = 0;
+        range.dest_offset   = copy->done;
+        ret = ioctl(copy->dst, FICLONERANGE, &range);
+    }
+
+    /* cloning does not shrink a longer destination kept for --delta */
+    struct stat st;
+    if (ret == 0 && copy->dst_size > 0 && (fstat(copy->src, &st) != 0 ||
+                                           ftruncate(copy->dst,
+                                                     st.st_size) != 0)) {
+        fail_append(fail_list, copy->dst_path, "unable to set file size");
+        return ENGINE_FAIL;
+    }
+
+    if (ret == 0) {
+        copy_advance(copy, copy->file->xfer - copy->done);
+        return ENGINE_OK;
+    }
+
+    if (opts->clone == CLONE_ALWAYS) {
+        fail_append(fail_list, copy->dst_path, "unable to clone file");
+        return ENGINE_FAIL;
+    }
+
+    errno = 0;
+    return ENGINE_UNSUPP;
+}
+
+/* in-kernel copy via copy_file_range(), allows server-side copy on NFS/CIFS */
+static int copy_range(copy_t *copy, strlist_t *fail_list)
+{
+    ssize_t n;
+
+    do {
+        n = copy_file_range(copy->src, NULL, copy->dst, NULL, copy->chunk,
+                            0);
+        if (n > 0)
+            copy_advance(copy, n);
+    } while (n > 0 || (n < 0 && errno == EINTR));
+
+    /* some pseudo filesystems silently report EOF instantly */
+    if (n == 0 && (copy->done > 0 || copy->file->size == 0))
+        return ENGINE_OK;
+    if (n == 0 || engine_unsupported(errno)) {
+        errno = 0;
+        return ENGINE_UNSUPP;
+    }
+
+    fail_append(fail_list, copy->dst_path, "I/O error during in-kernel copy");
+    return ENGINE_FAIL;
+}
+
+/* in-kernel copy via sendfile(), for kernels without copy_file_range() */
+static int copy_sendfile(copy_t *copy, strlist_t *fail_list)
+{
+    ssize_t n;
+
+    do {
+        n = sendfile(copy->dst, copy->src, NULL, copy->chunk);
+        if (n > 0)
+            copy_advance(copy, n);
+    } while (n > 0 || (n < 0 && errno == EINTR));
+
+    if (n == 0 && (copy->done > 0 || copy->file->size == 0))
+        return ENGINE_OK;
+    if (n == 0 || engine_unsupported(errno)) {
+        errno = 0;
+        return ENGINE_UNSUPP;
+    }
+
+    fail_append(fail_list, copy->dst_path, "I/O error during in-kernel copy");
+    return ENGINE_FAIL;
+}
+
+/* buffer for the next chunk, grown if tuning asks for more */
+static char *copy_buffer(copy_t *copy)
+{
+    if (buffer_reserve(copy->buffer, copy->chunk) != 0) {
+        copy->chunk     = copy->buffer->size;
+        copy->tune_dir  = 0;
+    }
+
+    return copy->buffer->data;
+}
+
+/* classic read()/write() loop through user-space buffer */
+static int copy_buffered(copy_t *copy, strlist_t *fail_list)
+{
+    char *buffer;
+    ssize_t n;
+
+    while ((n = read(copy->src, buffer = copy_buffer(copy),
+                     copy->chunk)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            fail_append(fail_list, copy->src_path, "I/O error while reading");
+            return ENGINE_FAIL;
         }
-        progress_alive = 1;
-        progress_bytes = 0;
-        file_list = flist;
-        options = opts;
-        if (pthread_create(&prg_thread, NULL, progress_thread, file) != 0) {
-            print_error("failed to spawn progress thread, doing silent copy");
-            progress_alive = 0;
+        if (write_all(copy->dst, buffer, n) != 0) {
+            fail_append(fail_list, copy->dst_path, "I/O error while writing");
+            return ENGINE_FAIL;
         }
+        copy_sum(copy, buffer, n);
+        copy_advance(copy, n);
     }
 
-    /* perform actual file I/O */
+    return ENGINE_OK;
+}
+
+/* write given buffer completely at given offset */
+static int pwrite_all(int fd, char *buffer, size_t count, off_t offset)
+{
+    ssize_t n;
+
+    while (count > 0) {
+        n = pwrite(fd, buffer, count, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buffer += n;
+        count -= n;
+        offset += n;
+    }
+
+    return 0;
+}
+
+/* write given buffer at given offset, leave holes for blocks that are all
+ * zero if requested (see --sparse=always) */
+static int copy_write(copy_t *copy, char *buffer, size_t count, off_t offset)
+{
+    size_t block = copy->zero_block, start = 0, pos = 0;
+
+    if (block == 0)
+        return pwrite_all(copy->dst, buffer, count, offset);
+
+    while (pos < count) {
+        size_t len = (count - pos > block) ? block : count - pos;
+        if (zero_block(buffer + pos, len)) {
+            if (pos > start && pwrite_all(copy->dst, buffer + start,
+                                          pos - start, offset + start) != 0)
+                return -1;
+            start = pos + len;
+        }
+        pos += len;
+    }
+
+    if (pos > start)
+        return pwrite_all(copy->dst, buffer + start, pos - start,
+                          offset + start);
+
+    return 0;
+}
+
+/* read given number of bytes at given offset unless EOF comes first,
+ * returns the number of bytes read or -1 */
+static ssize_t pread_all(int fd, char *buffer, size_t count, off_t offset)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < count) {
+        n = pread(fd, buffer + done, count - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+
+    return done;
+}
+
+/* update existing destination in place: compare chunks of both files in
+ * DELTA_BLOCK units, write runs of differing blocks only, cut off what is
+ * left beyond the source size */
+static int copy_delta(copy_t *copy, strlist_t *fail_list)
+{
+    size_t chunk = copy->chunk;
+    if (buffer_reserve(copy->buffer, 2 * chunk) != 0) {
+        fail_append(fail_list, copy->src_path, "failed to allocate I/O buffer");
+        return ENGINE_FAIL;
+    }
+    char *src_buf = copy->buffer->data;
+    char *dst_buf = src_buf + chunk;
+    off_t off = 0, written = 0;
+    ssize_t n, m;
+
+    while ((n = pread_all(copy->src, src_buf, chunk, off)) > 0) {
+        m = pread_all(copy->dst, dst_buf, n, off);
+        if (m < 0) {
+            fail_append(fail_list, copy->dst_path, "I/O error while reading");
+            return ENGINE_FAIL;
+        }
+
+        /* blocks past the old end differ anyway */
+        size_t pos = 0, start = 0, end = n;
+        int ret = 0;
+        while (ret == 0 && pos < end) {
+            size_t len = (end - pos > DELTA_BLOCK) ? DELTA_BLOCK : end - pos;
+            if (pos + len <= (size_t)m &&
+                    memcmp(src_buf + pos, dst_buf + pos, len) == 0) {
+                if (pos > start)
+                    ret = pwrite_all(copy->dst, src_buf + start, pos - start,
+                                     off + start);
+                written += pos - start;
+                start = pos + len;
+            }
+            pos += len;
+        }
+        if (ret == 0 && pos > start) {
+            ret = pwrite_all(copy->dst, src_buf + start, pos - start,
+                             off + start);
+            written += pos - start;
+        }
+        if (ret != 0) {
+            fail_append(fail_list, copy->dst_path, "I/O error while writing");
+            return ENGINE_FAIL;
+        }
+        copy_sum(copy, src_buf, n);
+        copy_advance(copy, n);
+        off += n;
+    }
+    if (n < 0) {
+        fail_append(fail_list, copy->src_path, "I/O error while reading");
+        return ENGINE_FAIL;
+    }
+    if (ftruncate(copy->dst, off) != 0) {
+        fail_append(fail_list, copy->dst_path, "unable to set file size");
+        return ENGINE_FAIL;
+    }
+    print_debug("updated '%s' in place: %lld of %lld bytes written",
+                copy->dst_path, (long long)written, (long long)off);
+
+    return ENGINE_OK;
+}
+
+/* reserve destination blocks in one go, fails early if space is short,
+ * evtl. sets final size so that ranges can be written in any order */
+static int copy_reserve(copy_t *copy, strlist_t *fail_list, char set_size)
+{
+    int mode = set_size ? 0 : FALLOC_FL_KEEP_SIZE;
+
+    if (fallocate(copy->dst, mode, 0, copy->file->size) == 0)
+        return 0;
+
+    /* unsupported by filesystem: fine, unless size has to be set */
+    if (errno == EOPNOTSUPP || errno == ENOSYS) {
+        errno = 0;
+        if (!set_size || ftruncate(copy->dst, copy->file->size) == 0)
+            return 0;
+    }
+
+    fail_append(fail_list, copy->dst_path, (errno == ENOSPC ||
+                errno == EDQUOT) ? "not enough space for file" :
+                "unable to preallocate file");
+    return -1;
+}
+
+/* copy given byte range using explicit offsets, in-kernel while possible */
+static int copy_span(copy_t *copy, off_t off, off_t end, char *buffer,
+                     size_t buff_size, char *kernel)
+{
+    ssize_t n;
+
+    while (off < end) {
+        size_t len = (end - off > (off_t)buff_size) ? buff_size :
+                     (size_t)(end - off);
+        if (*kernel) {
+            off_t off_in = off, off_out = off;
+            n = copy_file_range(copy->src, &off_in, copy->dst, &off_out, len,
+                                0);
+            /* some filesystems report EOF for ranges they cannot copy
+             * (e.g. across devices), the buffered path tells for sure */
+            if ((n < 0 && engine_unsupported(errno)) || n == 0) {
+                *kernel = 0;
+                errno = 0;
+                continue;
+            }
+        } else {
+            n = pread(copy->src, buffer, len, off);
+            if (n > 0 && copy_write(copy, buffer, n, off) != 0)
+                return -1;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = ENODATA;
+            return -1;
+        }
+        off += n;
+        copy_advance(copy, n);
+    }
+
+    return 0;
+}
+
+/* take ranges from given split until all are done or one failed */
+static void split_work(split_t *split, char *buffer, size_t buff_size)
+{
+    /* private copy state, byte counter must not be shared */
+    copy_t copy = *split->copy;
+    off_t off, end, size = copy.file->size;
+    char kernel = 1, stop;
+
+    /* windows make no sense here, pages are dropped on close */
+    copy.window     = LLONG_MAX - CACHE_WINDOW;
+    copy.tune_dir   = 0;
+
+    while (1) {
+        pthread_mutex_lock(&split->lock);
+        off = split->next;
+        split->next += RANGE_SIZE;
+        stop = split->failed;
+        pthread_mutex_unlock(&split->lock);
+        if (stop || off >= size)
+            break;
+
+        end = (size - off > RANGE_SIZE) ? off + RANGE_SIZE : size;
+        if (copy_span(&copy, off, end, buffer, buff_size, &kernel) == 0)
+            continue;
+
+        char msg[64];
+        snprintf(msg, sizeof(msg), "failed to copy range at offset %lld",
+                 (long long)off);
+        fail_append(split->fail_list, copy.dst_path, msg);
+        pthread_mutex_lock(&split->lock);
+        split->failed = 1;
+        pthread_mutex_unlock(&split->lock);
+    }
+}
+
+static void *split_thread(void *arg)
+{
+    split_t *split = (split_t *)arg;
+    size_t buff_size = split->copy->chunk;
+    char *buffer = malloc(buff_size);
+
+    if (buffer == NULL) {
+        print_error("failed to allocate I/O buffer for range copy");
+        return NULL;
+    }
+    split_work(split, buffer, buff_size);
+    free(buffer);
+
+    return NULL;
+}
+
+/* copy data segments only, leaving holes in destination */
+static int copy_sparse(copy_t *copy, strlist_t *fail_list, opts_t *opts,
+                       char *buffer, size_t buff_size)
+{
+    off_t data, hole = 0, size = copy->file->size;
+    char kernel = 1;
+
+    /* data has to pass the buffer to be scanned for zero blocks */
+    if (opts->sparse == SPARSE_ALWAYS) {
+        struct stat st;
+        copy->zero_block = (fstat(copy->dst, &st) == 0 && st.st_blksize > 0 &&
+                            (size_t)st.st_blksize <= buff_size) ?
+                           (size_t)st.st_blksize : 4096;
+        kernel = 0;
+    }
+
+    while (hole < size) {
+        data = lseek(copy->src, hole, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+            break;
+        if (data < 0 && hole == 0 && engine_unsupported(errno)) {
+            errno = 0;
+            if (!copy->zero_block)
+                return ENGINE_UNSUPP;
+            /* no hole information, scan the whole file */
+            data = 0;
+            hole = size;
+        } else if (data >= 0) {
+            hole = lseek(copy->src, data, SEEK_HOLE);
+        }
+        if (data < 0 || hole < 0) {
+            fail_append(fail_list, copy->src_path, "unable to seek data");
+            return ENGINE_FAIL;
+        }
+        if (hole > size)
+            hole = size;
+        if (copy_span(copy, data, hole, buffer, buff_size, &kernel) != 0) {
+            fail_append(fail_list, copy->dst_path, "I/O error while copying");
+            return ENGINE_FAIL;
+        }
+    }
+
+    /* trailing hole */
+    if (ftruncate(copy->dst, size) != 0) {
+        fail_append(fail_list, copy->dst_path, "unable to set file size");
+        return ENGINE_FAIL;
+    }
+
+    return ENGINE_OK;
+}
+
+/* copy large file as fixed-size ranges by several threads concurrently */
+static int copy_split(copy_t *copy, strlist_t *fail_list, opts_t *opts,
+                      char *buffer, size_t buff_size)
+{
+    if (copy_reserve(copy, fail_list, 1) != 0)
+        return ENGINE_FAIL;
+
+    split_t split;
+    split.copy      = copy;
+    split.fail_list = fail_list;
+    split.next      = 0;
+    split.failed    = 0;
+    pthread_mutex_init(&split.lock, NULL);
+
+    /* calling thread takes part as well */
+    pthread_t *threads = malloc((opts->streams - 1) * sizeof(pthread_t));
+    unsigned int n_threads = 0;
+    while (threads != NULL && n_threads < opts->streams - 1) {
+        if (pthread_create(&threads[n_threads], NULL, split_thread,
+                           &split) != 0)
+            break;
+        n_threads++;
+    }
+    print_debug("copying '%s' in ranges by %u threads", copy->src_path,
+                n_threads + 1);
+    split_work(&split, buffer, buff_size);
+    for (unsigned int i = 0; i < n_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&split.lock);
+
+    if (split.failed)
+        return ENGINE_FAIL;
+
+    copy->done = copy->file->size;
+    return ENGINE_OK;
+}
+
+/* reader side of pipelined copy: fill free buffers from source */
+static void *pipe_reader(void *arg)
+{
+    pipe_t *pipe = (pipe_t *)arg;
+    ssize_t n;
+
     do {
-        n_read  = fread(buffer, 1, buff_size, src);
-        n_writt = fwrite(buffer, 1, n_read, dst);
-        if (progress_alive) {
-            pthread_mutex_lock(&progress_lock);
-            progress_bytes += n_read;
-            pthread_mutex_unlock(&progress_lock);
+        sem_wait(&pipe->empty);
+        if (__atomic_load_n(&pipe->abort, __ATOMIC_ACQUIRE))
+            break;
+
+        unsigned int slot = pipe->head % PIPE_DEPTH;
+        do {
+            n = read(pipe->src, pipe->buffers + slot * pipe->buff_size,
+                     pipe->buff_size);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0)
+            pipe->error = errno;
+        pipe->fill[slot] = n;
+
+        pipe->head++;
+        sem_post(&pipe->filled);
+    } while (n > 0);
+
+    return NULL;
+}
+
+/* overlap reading and writing: reader thread fills buffers while the
+ * calling thread drains them to the destination */
+static int copy_pipeline(copy_t *copy, strlist_t *fail_list, size_t buff_size)
+{
+    pipe_t pipe;
+    pipe.buffers    = malloc(PIPE_DEPTH * buff_size);
+    pipe.buff_size  = buff_size;
+    pipe.head       = 0;
+    pipe.tail       = 0;
+    pipe.src        = copy->src;
+    pipe.error      = 0;
+    pipe.abort      = 0;
+    if (pipe.buffers == NULL)
+        return ENGINE_UNSUPP;
+    sem_init(&pipe.filled, 0, 0);
+    sem_init(&pipe.empty, 0, PIPE_DEPTH);
+
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, pipe_reader, &pipe) != 0) {
+        print_debug("failed to spawn reader thread");
+        sem_destroy(&pipe.filled);
+        sem_destroy(&pipe.empty);
+        free(pipe.buffers);
+        return ENGINE_UNSUPP;
+    }
+
+    int ret = ENGINE_OK;
+    while (1) {
+        sem_wait(&pipe.filled);
+        unsigned int slot = pipe.tail % PIPE_DEPTH;
+        ssize_t n = pipe.fill[slot];
+        if (n == 0)
+            break;
+        if (n < 0) {
+            errno = pipe.error;
+            fail_append(fail_list, copy->src_path, "I/O error while reading");
+            ret = ENGINE_FAIL;
+            break;
         }
-    } while (n_read > 0 && n_writt == n_read);
+        if (write_all(copy->dst, pipe.buffers + slot * buff_size, n) != 0) {
+            fail_append(fail_list, copy->dst_path, "I/O error while writing");
+            /* wake reader in case it waits for a free buffer */
+            __atomic_store_n(&pipe.abort, 1, __ATOMIC_RELEASE);
+            sem_post(&pipe.empty);
+            ret = ENGINE_FAIL;
+            break;
+        }
+        copy_sum(copy, pipe.buffers + slot * buff_size, n);
+        copy_advance(copy, n);
 
-    if (progress_alive) {
-        progress_alive = 0;
-        pthread_join(prg_thread, NULL);
-        pthread_mutex_destroy(&progress_lock);
+        pipe.tail++;
+        sem_post(&pipe.empty);
+    }
+
+    pthread_join(reader, NULL);
+    sem_destroy(&pipe.filled);
+    sem_destroy(&pipe.empty);
+    free(pipe.buffers);
+
+    return ret;
+}
+
+/* required alignment of offsets and lengths for O_DIRECT on given file */
+static size_t direct_align(int fd)
+{
+    size_t align = sysconf(_SC_PAGESIZE);
+
+#ifdef STATX_DIOALIGN
+    /* logical block size of the underlying device, Linux 6.1+ */
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+            (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align > 0)
+        align = stx.stx_dio_offset_align;
+#endif
+
+    return align;
+}
+
+/* read()/write() loop bypassing the page cache, buffer must be aligned */
+static int copy_direct(copy_t *copy, strlist_t *fail_list)
+{
+    size_t align = direct_align(copy->src_direct ? copy->src : copy->dst);
+    if (copy->src_direct && copy->dst_direct) {
+        size_t align_dst = direct_align(copy->dst);
+        if (align_dst > align)
+            align = align_dst;
     }
+    if (copy->chunk < align)
+        return ENGINE_UNSUPP;
 
-    /* error handling */
-    if (ferror(src) || ferror(dst)) {
-        fail_append(fail_list, ferror(src) ? file->src : file->dst,
-                    ferror(src) ? "I/O error while reading" :
-                    "unable to open for writing");
-        fclose(src);
-        fclose(dst);
-        if (remove(file->dst) != 0)
-            fail_append(fail_list, file->dst, "failed to remove partial file");
+    char *buffer;
+    ssize_t n;
+    while ((n = read(copy->src, buffer = copy_buffer(copy),
+                     copy->chunk - copy->chunk % align)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            fail_append(fail_list, copy->src_path, "I/O error while reading");
+            return ENGINE_FAIL;
+        }
+        /* unaligned tail cannot be written directly */
+        if (copy->dst_direct && n % align != 0) {
+            int flags = fcntl(copy->dst, F_GETFL);
+            if (flags < 0 || fcntl(copy->dst, F_SETFL, flags & ~O_DIRECT)) {
+                fail_append(fail_list, copy->dst_path,
+                            "unable to leave direct I/O mode");
+                return ENGINE_FAIL;
+            }
+            copy->dst_direct = 0;
+        }
+        if (write_all(copy->dst, buffer, n) != 0) {
+            fail_append(fail_list, copy->dst_path, "I/O error while writing");
+            return ENGINE_FAIL;
+        }
+        copy_sum(copy, buffer, n);
+        copy_advance(copy, n);
+    }
+
+    return ENGINE_OK;
+}
+
+/* optimal I/O size of the block device given by its number, 0 if unknown,
+ * e.g. the stripe width of a RAID */
+static size_t device_io_size(dev_t dev)
+{
+    size_t io_size = 0;
+
+    pthread_mutex_lock(&dev_lock);
+    for (unsigned int i = 0; i < dev_cached; i++) {
+        if (dev_cache[i].dev == dev) {
+            io_size = dev_cache[i].io_size;
+            pthread_mutex_unlock(&dev_lock);
+            return io_size;
+        }
+    }
+
+    /* queue attributes of partitions are found at the parent device */
+    static const char *paths[] = {
+        "/sys/dev/block/%u:%u/queue/optimal_io_size",
+        "/sys/dev/block/%u:%u/../queue/optimal_io_size"
+    };
+    for (unsigned int i = 0; i < 2 && io_size == 0; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), paths[i], major(dev), minor(dev));
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL)
+            continue;
+        unsigned long value;
+        if (fscanf(fp, "%lu", &value) == 1)
+            io_size = value;
+        fclose(fp);
+    }
+
+    if (dev_cached < DEV_CACHE) {
+        dev_cache[dev_cached].dev       = dev;
+        dev_cache[dev_cached].io_size   = io_size;
+        dev_cached++;
+    }
+    pthread_mutex_unlock(&dev_lock);
+
+    return io_size;
+}
+
+/* choose initial I/O size from block sizes and device hints, bounded by
+ * file size, enable tuning for files that take a while */
+static void copy_chunk(copy_t *copy, opts_t *opts)
+{
+    off_t size = copy->file->size;
+    size_t block = 4096, io_size = 0, chunk = BUFFS;
+    struct stat st;
+    int fds[2] = { copy->src, copy->dst };
+
+    if (opts->buffer > 0) {
+        copy->chunk = opts->buffer;
+        return;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (fstat(fds[i], &st) != 0)
+            continue;
+        if (st.st_blksize > 0 && (size_t)st.st_blksize > block)
+            block = st.st_blksize;
+        size_t dev_size = device_io_size(st.st_dev);
+        if (dev_size > io_size)
+            io_size = dev_size;
+    }
+
+    /* whole multiples of the device's preferred size */
+    if (io_size > 0 && io_size <= BUFF_MAX)
+        chunk = (chunk + io_size - 1) / io_size * io_size;
+    if (block > chunk)
+        chunk = block;
+
+    /* no point in a buffer larger than the file */
+    if ((off_t)chunk > size)
+        chunk = (size + block - 1) / block * block;
+    if (chunk == 0)
+        chunk = block;
+    copy->chunk = chunk;
+
+    if (size >= 4 * TUNE_WINDOW) {
+        copy->tune_dir      = 1;
+        copy->tune_first    = chunk;
+        copy->tune_best     = chunk;
+        copy->tune_rate     = 0;
+        copy->tune_done     = 0;
+        clock_gettime(CLOCK_MONOTONIC, &copy->tune_time);
+    }
+    print_debug("I/O size for '%s': %zu (block %zu, device %zu)",
+                copy->src_path, chunk, block, io_size);
+}
+
+/* transfer file contents, trying the cheapest engine first */
+static int copy_data(copy_t *copy, strlist_t *fail_list, opts_t *opts)
+{
+    char *buffer = copy->buffer->data;
+    size_t buff_size = copy->chunk;
+    int ret = ENGINE_UNSUPP;
+
+    /* checksums need all data to pass the buffer, in file order */
+    char kernel = !copy->summing;
+
+    if (opts->clone != CLONE_NEVER && kernel) {
+        ret = copy_clone(copy, fail_list, opts);
+        if (ret == ENGINE_UNSUPP)
+            print_debug("cloning unsupported, copying data");
+    }
+
+    /* existing destination: write differences only (see --delta) */
+    if (ret == ENGINE_UNSUPP && copy->dst_size > 0) {
+        ret = copy_delta(copy, fail_list);
+        if (ret != ENGINE_UNSUPP)
+            return ret;
+    }
+
+    /* before preallocation, which would fill the holes */
+    if (ret == ENGINE_UNSUPP && COPY_SPARSE(copy->file, opts) && kernel &&
+            !copy->src_direct && !copy->dst_direct) {
+        ret = copy_sparse(copy, fail_list, opts, buffer, buff_size);
+        if (ret != ENGINE_UNSUPP)
+            return ret;
+    }
+
+    if (ret == ENGINE_UNSUPP && COPY_SPLIT(copy->file, opts) && kernel &&
+            !copy->src_direct && !copy->dst_direct)
+        return copy_split(copy, fail_list, opts, buffer, buff_size);
+
+    /* preallocate to avoid fragmentation, small files are left to the
+     * filesystem's delayed allocation */
+    if (ret == ENGINE_UNSUPP && copy->file->size > BUFFS &&
+            copy_reserve(copy, fail_list, 0) != 0)
+        return ENGINE_FAIL;
+
+    if (ret == ENGINE_UNSUPP && (copy->src_direct || copy->dst_direct)) {
+        ret = copy_direct(copy, fail_list);
+        if (ret != ENGINE_UNSUPP)
+            return ret;
+    }
+
+    if (ret == ENGINE_UNSUPP && opts->pipeline)
+        ret = copy_pipeline(copy, fail_list, buff_size);
+
+    /* engines continue at current file offsets, so fallback is seamless */
+    if (ret == ENGINE_UNSUPP && kernel)
+        ret = copy_range(copy, fail_list);
+    if (ret == ENGINE_UNSUPP && kernel) {
+        print_debug("copy_file_range() unsupported, trying sendfile()");
+        ret = copy_sendfile(copy, fail_list);
+        if (ret == ENGINE_UNSUPP)
+            print_debug("sendfile() unsupported, using buffered copy");
+    }
+    if (ret == ENGINE_UNSUPP)
+        ret = copy_buffered(copy, fail_list);
+
+    return ret;
+}
+
+/* open given file, evtl. bypassing page cache if filesystem allows */
+static int open_file(char *path, int flags, char direct, char *is_direct)
+{
+    int fd;
+
+    /* not every filesystem supports O_DIRECT (e.g. tmpfs) */
+    if (direct) {
+        fd = open(path, flags | O_DIRECT, 0666);
+        *is_direct = fd >= 0;
+        if (fd >= 0 || errno != EINVAL)
+            return fd;
+        errno = 0;
+    }
+
+    *is_direct = 0;
+    return open(path, flags, 0666);
+}
+
+/* continue transfer of given file behind the committed part of the
+ * destination, aligned for O_DIRECT and cloning; starts over if the
+ * destination is not as expected */
+static void copy_resume(copy_t *copy, off_t offset)
+{
+    struct stat st;
+
+    offset -= offset % 4096;
+    if (fstat(copy->dst, &st) != 0 || st.st_size < offset ||
+            offset > copy->file->size || ftruncate(copy->dst, offset) != 0 ||
+            lseek(copy->src, offset, SEEK_SET) != offset ||
+            lseek(copy->dst, offset, SEEK_SET) != offset)
+        offset = 0;
+    if (offset == 0) {
+        lseek(copy->src, 0, SEEK_SET);
+        lseek(copy->dst, 0, SEEK_SET);
+        if (ftruncate(copy->dst, 0) != 0)
+            print_debug("failed to truncate '%s'", copy->dst_path);
+        errno = 0;
+        return;
+    }
+
+    copy->done          = offset;
+    copy->committed     = offset;
+    copy->window        = offset;
+    copy->window_prev   = offset;
+    print_debug("resuming '%s' at %lld", copy->dst_path, (long long)offset);
+}
+
+/* open source and destination of given file, continue behind 'resume'
+ * bytes of an existing destination if given */
+static int copy_open(copy_t *copy, file_t *file, opts_t *opts, char direct,
+                     off_t resume, strlist_t *fail_list)
+{
+    copy->file          = file;
+    copy->done          = 0;
+    copy->window        = 0;
+    copy->window_prev   = 0;
+    copy->zero_block    = 0;
+    copy->journal       = NULL;
+    copy->committed     = 0;
+    copy->summing       = COPY_SUMMED(opts);
+    xxh64_init(&copy->sum, 0);
+    copy->buffer        = NULL;
+    copy->chunk         = BUFFS;
+    copy->tune_dir      = 0;
+    f_src_path(file, copy->src_path);
+    f_dst_path(file, copy->dst_path);
+    copy->src = open_file(copy->src_path, O_RDONLY, direct,
+                          &copy->src_direct);
+    if (copy->src < 0) {
+        fail_append(fail_list, copy->src_path, "unable to open for reading");
         return -1;
     }
+    /* existing contents are kept for comparison in delta mode */
+    char delta = COPY_DELTA(file, opts) && !direct;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    if (delta)
+        flags = O_RDWR | O_CREAT;
+    else if (resume > 0)
+        flags = O_WRONLY | O_CREAT;
+    struct stat st;
+    st.st_size = 0;
+    copy->dst = open_file(copy->dst_path, flags, direct, &copy->dst_direct);
+    if (copy->dst >= 0 && delta && fstat(copy->dst, &st) != 0) {
+        close(copy->dst);
+        copy->dst = -1;
+    }
+    if (copy->dst < 0) {
+        fail_append(fail_list, copy->dst_path, "unable to open for writing");
+        close(copy->src);
+        return -1;
+    }
+    copy->dst_size = st.st_size;
+    copy->in_place = copy->dst_size > 0 || resume > 0;
+    if (resume > 0 && !delta)
+        copy_resume(copy, resume);
+
+    /* announce sequential access, start read-ahead of first window */
+    copy->nocache = opts->nocache && !copy->dst_direct;
+    if (!copy->src_direct && file->size > BUFFS) {
+        posix_fadvise(copy->src, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(copy->src, 0, CACHE_WINDOW, POSIX_FADV_WILLNEED);
+    }
+
+    return 0;
+}
+
+/* sync and close given transfer, remove destination if it failed */
+static int copy_close(copy_t *copy, opts_t *opts, strlist_t *fail_list,
+                      int failed)
+{
+    file_t *file = copy->file;
 
     /* fsync if requested */
-    if (opts->sync) {
-        if (fsync(fileno(dst)) != 0) {
-            fail_append(fail_list, file->dst, "failed to fsync() file to disk");
-            fclose(src);
-            fclose(dst);
-            return -1;
-        }
+    if (!failed && opts->sync && fsync(copy->dst) != 0) {
+        fail_append(fail_list, copy->dst_path,
+                    "failed to fsync() file to disk");
+        failed = 1;
     }
 
-    fclose(src);
-    fclose(dst);
+    /* drop what is left of the file from page cache */
+    if (copy->nocache) {
+        sync_file_range(copy->dst, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+                        SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(copy->dst, 0, 0, POSIX_FADV_DONTNEED);
+        posix_fadvise(copy->src, 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    close(copy->src);
+    if (close(copy->dst) != 0 && !failed) {
+        fail_append(fail_list, copy->dst_path, "I/O error while closing");
+        failed = 1;
+    }
+
+    /* error handling: a destination updated in place (--delta) or to be
+     * resumed is left for the next run, the error has been reported */
+    if (failed) {
+        if (!copy->in_place && remove(copy->dst_path) != 0)
+            fail_append(fail_list, copy->dst_path,
+                        "failed to remove partial file");
+        return -1;
+    }
 
     /* clone attributes */
     if (f_clone_attrs(file) && !opts->ignore_uid_err) {
-        fail_append(fail_list, file->dst, "failed to apply attributes");
+        fail_append(fail_list, copy->dst_path, "failed to apply attributes");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* hash the part of the source copied before resuming (--checksum) */
+static int copy_sum_head(copy_t *copy, strlist_t *fail_list)
+{
+    size_t len = copy->buffer->size - copy->buffer->size % 4096;
+    off_t off = 0;
+
+    while (off < copy->done) {
+        size_t count = (copy->done - off > (off_t)len) ? len :
+                       (size_t)(copy->done - off);
+        ssize_t n = pread(copy->src, copy->buffer->data, count, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            fail_append(fail_list, copy->src_path, "I/O error while reading");
+            return -1;
+        }
+        copy_sum(copy, copy->buffer->data, n);
+        off += n;
+    }
+
+    return 0;
+}
+
+/* read back destination, bypassing the page cache, and compare its
+ * checksum to the one taken while copying (--verify); without O_DIRECT
+ * (e.g. tmpfs) the written pages are dropped from the cache first, which
+ * the kernel may not do for pages still in use elsewhere */
+static int copy_verify(copy_t *copy, strlist_t *fail_list)
+{
+    /* worker buffers are page-aligned when verifying */
+    char direct;
+    int fd = open_file(copy->dst_path, O_RDONLY, copy->buffer->aligned,
+                       &direct);
+    if (fd < 0) {
+        fail_append(fail_list, copy->dst_path, "unable to open for reading");
+        return -1;
+    }
+
+    /* stricter alignment than the buffer's is not bothered with */
+    size_t align = direct ? direct_align(fd) : 1;
+    if (align > (size_t)sysconf(_SC_PAGESIZE)) {
+        close(fd);
+        fd = open(copy->dst_path, O_RDONLY);
+        direct = 0;
+        align = 1;
+        if (fd < 0) {
+            fail_append(fail_list, copy->dst_path,
+                        "unable to open for reading");
+            return -1;
+        }
+    }
+
+    /* cached pages would just give back what has been written, they can
+     * only be dropped once clean */
+    if (!direct) {
+        if (fdatasync(copy->dst) != 0) {
+            fail_append(fail_list, copy->dst_path,
+                        "I/O error while verifying");
+            close(fd);
+            return -1;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    /* a read shorter than the alignment would be mistaken for the end */
+    if (buffer_reserve(copy->buffer, align) != 0) {
+        fail_append(fail_list, copy->dst_path, "failed to allocate I/O buffer");
+        close(fd);
+        return -1;
+    }
+    size_t len = copy->buffer->size - copy->buffer->size % align;
+    xxh64_t sum;
+    xxh64_init(&sum, 0);
+    off_t off = 0;
+    ssize_t n;
+    while ((n = pread(fd, copy->buffer->data, len, off)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        xxh64_update(&sum, copy->buffer->data, n);
+        off += n;
+        /* unaligned offsets after the end are not allowed with O_DIRECT */
+        if ((size_t)n < len)
+            break;
+    }
+    close(fd);
+
+    if (n < 0) {
+        fail_append(fail_list, copy->dst_path, "I/O error while verifying");
+        return -1;
+    }
+    if (off != copy->done || xxh64_digest(&sum) != copy->file->sum) {
+        errno = 0;
+        fail_append(fail_list, copy->dst_path, "checksum mismatch");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* initialize stats, spawn progress thread if reasonable */
+static void progress_start(file_t *file, flist_t *flist, opts_t *opts,
+                           pthread_t *thread)
+{
+    /* parallel workers feed the shared progress thread instead */
+    if (progress_shared)
+        return;
+
+    progress_alive = 0;
+    if (opts->quiet || file->xfer <= BUFFS * BUFFM)
+        return;
+
+    if (pthread_mutex_init(&progress_lock, NULL) != 0) {
+        print_error("failed to initialize mutex, doing silent copy");
+        return;
+    }
+    progress_alive = 1;
+    progress_bytes = 0;
+    file_list = flist;
+    options = opts;
+    if (pthread_create(thread, NULL, progress_thread, file) != 0) {
+        print_error("failed to spawn progress thread, doing silent copy");
+        progress_alive = 0;
+        pthread_mutex_destroy(&progress_lock);
+    }
+}
+
+static void progress_stop(pthread_t *thread)
+{
+    if (progress_shared || !progress_alive)
+        return;
+
+    progress_alive = 0;
+    pthread_join(*thread, NULL);
+    pthread_mutex_destroy(&progress_lock);
+}
+
+int copy_file(file_t *file, flist_t *flist, strlist_t *fail_list, opts_t *opts,
+              buffer_t *buffer)
+{
+    /* progress is committed where the data is written in file order */
+    char dst[PATH_MAX];
+    off_t resume = 0;
+    journal_t *journal = NULL;
+    if (flist->journal != NULL && !COPY_SPLIT(file, opts) &&
+            !COPY_SPARSE(file, opts) && !COPY_DELTA(file, opts)) {
+        journal = flist->journal;
+        if (journal_state(journal, f_dst_path(file, dst), file,
+                          &resume) != JOURNAL_PARTIAL)
+            resume = 0;
+    }
+
+    copy_t copy;
+    if (copy_open(&copy, file, opts, COPY_DIRECT(file, opts), resume,
+                  fail_list) != 0)
+        return -1;
+    copy.journal = journal;
+
+    copy.buffer = buffer;
+    copy_chunk(&copy, opts);
+    if (buffer_reserve(buffer, copy.chunk) != 0) {
+        fail_append(fail_list, copy.src_path, "failed to allocate I/O buffer");
+        return copy_close(&copy, opts, fail_list, 1);
+    }
+
+    pthread_t prg_thread;
+    progress_start(file, flist, opts, &prg_thread);
+
+    /* perform actual file I/O */
+    int ret = ENGINE_OK;
+    if (copy.summing && copy.done > 0 && copy_sum_head(&copy, fail_list) != 0)
+        ret = ENGINE_FAIL;
+    if (ret == ENGINE_OK)
+        ret = copy_data(&copy, fail_list, opts);
+
+    progress_stop(&prg_thread);
+
+    if (ret == ENGINE_OK && copy.summing) {
+        file->sum = xxh64_digest(&copy.sum);
+        if (opts->verify && copy_verify(&copy, fail_list) != 0)
+            ret = ENGINE_FAIL;
+    }
+
+    return copy_close(&copy, opts, fail_list, ret != ENGINE_OK);
+}
+
+void progress_begin(flist_t *flist, opts_t *opts)
+{
+    progress_shared = 1;
+    progress_alive = 0;
+    /* list is still being filled when streaming */
+    if (opts->quiet || (!opts->stream && flist->size <= flist->bytes_done))
+        return;
+
+    if (pthread_mutex_init(&progress_lock, NULL) != 0) {
+        print_error("failed to initialize mutex, doing silent copy");
+        return;
+    }
+    progress_alive = 1;
+    progress_bytes = 0;
+    file_list = flist;
+    options = opts;
+    if (pthread_create(&progress_tid, NULL, progress_thread, NULL) != 0) {
+        print_error("failed to spawn progress thread, doing silent copy");
+        progress_alive = 0;
+        pthread_mutex_destroy(&progress_lock);
+    }
+}
+
+void progress_end()
+{
+    progress_shared = 0;
+    if (!progress_alive)
+        return;
+
+    progress_alive = 0;
+    pthread_join(progress_tid, NULL);
+    pthread_mutex_destroy(&progress_lock);
+}
+
+/* progress callback for ring transfers */
+static void uring_advance(uring_job_t *job, size_t bytes)
+{
+    copy_advance((copy_t *)job->data, bytes);
+}
+
+int copy_batch(file_t **files, unsigned int count, flist_t *flist,
+               strlist_t *fail_list, opts_t *opts, uring_t *ring)
+{
+    copy_t *copies = malloc(count * sizeof(copy_t));
+    uring_job_t *jobs = malloc(count * sizeof(uring_job_t));
+    int *state = calloc(count, sizeof(int));
+    if (copies == NULL || jobs == NULL || state == NULL) {
+        char dst[PATH_MAX];
+        for (unsigned int i = 0; i < count; i++)
+            fail_append(fail_list, f_dst_path(files[i], dst), "out of memory");
+        free(copies);
+        free(jobs);
+        free(state);
         return -1;
     }
 
+    /* open all files, clone where possible, queue the rest for the ring */
+    unsigned int n_jobs = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        if (copy_open(&copies[i], files[i], opts, 0, 0, fail_list) != 0) {
+            state[i] = ENGINE_FAIL;
+            continue;
+        }
+        state[i] = ENGINE_UNSUPP;
+        if (opts->clone != CLONE_NEVER)
+            state[i] = copy_clone(&copies[i], fail_list, opts);
+        if (state[i] == ENGINE_UNSUPP && files[i]->size > BUFFS &&
+                copy_reserve(&copies[i], fail_list, 0) != 0)
+            state[i] = ENGINE_FAIL;
+        if (state[i] != ENGINE_UNSUPP)
+            continue;
+
+        uring_job_t *job = &jobs[n_jobs++];
+        job->src    = copies[i].src;
+        job->dst    = copies[i].dst;
+        job->size   = files[i]->size;
+        job->data   = &copies[i];
+    }
+
+    /* single large files get progress output like in copy_file() */
+    pthread_t prg_thread;
+    if (count == 1)
+        progress_start(files[0], flist, opts, &prg_thread);
+    uring_copy(ring, jobs, n_jobs, uring_advance);
+    if (count == 1)
+        progress_stop(&prg_thread);
+
+    /* map job results back, finish files */
+    int retval = 0;
+    for (unsigned int i = 0, j = 0; i < count; i++) {
+        if (state[i] == ENGINE_FAIL) {
+            retval = -1;
+            continue;
+        }
+        if (state[i] == ENGINE_UNSUPP) {
+            uring_job_t *job = &jobs[j++];
+            state[i] = ENGINE_OK;
+            if (job->error != 0) {
+                errno = job->error;
+                fail_append(fail_list, job->error_dst ? copies[i].dst_path :
+                            copies[i].src_path, job->error_dst ?
+                            "I/O error while writing" :
+                            "I/O error while reading");
+                state[i] = ENGINE_FAIL;
+            }
+        }
+        if (copy_close(&copies[i], opts, fail_list,
+                       state[i] != ENGINE_OK) != 0) {
+            retval = -1;
+            continue;
+        }
+        files[i]->done = 1;
+    }
+
+    free(copies);
+    free(jobs);
+    free(state);
+
+    return retval;
+}
+
+int buffer_reserve(buffer_t *buffer, size_t size)
+{
+    if (size <= buffer->size)
+        return 0;
+
+    /* contents need not be kept, so no realloc() */
+    char *data = NULL;
+    if (buffer->aligned) {
+        if (posix_memalign((void **)&data, sysconf(_SC_PAGESIZE),
+                           size) != 0)
+            data = NULL;
+    } else {
+        data = malloc(size);
+    }
+    if (data == NULL)
+        return -1;
+
+    free(buffer->data);
+    buffer->data = data;
+    buffer->size = size;
+
     return 0;
 }
 
 int copy_link(file_t *file, strlist_t *fail_list)
 {
+    char dst[PATH_MAX];
+    f_dst_path(file, dst);
+
     /* remove evtl. existing one */
-    if ((access(file->dst, F_OK) == 0) && (remove(file->dst) != 0)) {
-        fail_append(fail_list, file->dst, "unable to delete link");
+    if ((access(dst, F_OK) == 0) && (remove(dst) != 0)) {
+        fail_append(fail_list, dst, "unable to delete link");
         return -1;
     }
 
     /* create new link */
-    if (symlink(file->ldst, file->dst) != 0) {
-        fail_append(fail_list, file->dst, "unable to create symlink");
+    if (symlink(file->ldst, dst) != 0) {
+        fail_append(fail_list, dst, "unable to create symlink");
         return -1;
     }
 
     return 0;
 }
 
+int copy_hardlink(file_t *file)
+{
+    char target[PATH_MAX], dst[PATH_MAX];
+    f_dst_path(file->link, target);
+    f_dst_path(file, dst);
+
+    if (unlink(dst) != 0 && errno != ENOENT)
+        return -1;
+    errno = 0;
+
+    return link(target, dst);
+}
+
+int copy_reflink(file_t *file, opts_t *opts, strlist_t *fail_list)
+{
+    char target[PATH_MAX], dst[PATH_MAX];
+    f_dst_path(file->link, target);
+    f_dst_path(file, dst);
+
+    int src = open(target, O_RDONLY);
+    if (src < 0)
+        return -1;
+    int dst_fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (dst_fd < 0) {
+        close(src);
+        return -1;
+    }
+    int ret = ioctl(dst_fd, FICLONE, src);
+    close(src);
+    if (close(dst_fd) != 0 || ret != 0) {
+        errno = 0;
+        return -1;
+    }
+
+    if (f_clone_attrs(file) && !opts->ignore_uid_err) {
+        fail_append(fail_list, dst, "failed to apply attributes");
+        return 1;
+    }
+
+    return 0;
+}
+
 int copy_dir(file_t *file, opts_t *opts, strlist_t *fail_list)
 {
+    char dst[PATH_MAX];
+    f_dst_path(file, dst);
+
     /* create destination directory if not existing */
-    if (access(file->dst, F_OK) != 0 && mkdir(file->dst, file->mode) != 0) {
-        fail_append(fail_list, file->dst, "unable to create directory");
+    if (access(dst, F_OK) != 0 && mkdir(dst, file->mode) != 0) {
+        fail_append(fail_list, dst, "unable to create directory");
         return -1;
     }
 
     /* clone attributes */
     if (f_clone_attrs(file) && !opts->ignore_uid_err) {
-        fail_append(fail_list, file->dst, "failed to apply attributes");
+        fail_append(fail_list, dst, "failed to apply attributes");
         return -1;
     }
 
@@ -155,29 +1572,36 @@ void *progress_thread(void *arg)
 {
     file_t *item = (file_t *)arg;
     time_t start, now, elapsed;
+    off_t size, remaining;
+    char multi;
     char perc_t, perc_f, *speed;
     off_t bytes_per_sec;
     size_t bytes_written;
     int remaining_s;
     char eta_h, eta_m, eta_s;
 
-    perc_t = (long double)file_list->bytes_done / file_list->size * 100;
+    /* without item, show progress of the remaining list as a whole */
+    off_t done_start = file_list->bytes_done;
+    size = (item != NULL) ? item->xfer : file_list->size - done_start;
+    multi = item != NULL && file_list->count_f > 1;
+    perc_t = (file_list->size > 0) ? (long double)file_list->bytes_done /
+             file_list->size * 100 : 0;
     bytes_written = 0;
     time(&start);
 
     /* initial output */
-    if (file_list->count_f > 1) {
+    if (multi) {
         if (options->bars) {
             print_progr_bm(0, perc_t, "0b", 0, 0, 0);
         } else {
-            print_progr_pm(0, perc_t, size_str(item->size),
+            print_progr_pm(0, perc_t, size_str(size),
                            size_str(file_list->size), "0b", 0, 0, 0);
         }
     } else {
         if (options->bars) {
             print_progr_bs(0, "0b", 0, 0, 0);
         } else {
-            print_progr_ps(0, size_str(item->size), "0b", 0, 0, 0);
+            print_progr_ps(0, size_str(size), "0b", 0, 0, 0);
         }
     }
 
@@ -203,13 +1627,25 @@ void *progress_thread(void *arg)
             elapsed = 1;
         }
         bytes_per_sec = (float)bytes_written / elapsed;
+        if (bytes_per_sec <= 0)
+            bytes_per_sec = 1;
         speed = size_str(bytes_per_sec);
+        /* total grows while streaming */
+        if (item == NULL)
+            size = file_list->size - done_start;
+        if (size <= 0)
+            size = 1;
         /* calculate percentage, ETA */
-        perc_f = (float)bytes_written / item->size * 100;
-        perc_t = (float)(file_list->bytes_done + bytes_written) /
-                 file_list->size * 100;
-        remaining_s = (file_list->size - (file_list->bytes_done +
-                                          bytes_written)) / bytes_per_sec;
+        perc_f = (float)bytes_written / size * 100;
+        if (multi) {
+            perc_t = (float)(file_list->bytes_done + bytes_written) /
+                     file_list->size * 100;
+            remaining = file_list->size - (file_list->bytes_done +
+                                           bytes_written);
+        } else {
+            remaining = size - bytes_written;
+        }
+        remaining_s = remaining / bytes_per_sec;
         eta_s = remaining_s % 60;
         eta_m = (remaining_s % 3600) / 60;
         eta_h = remaining_s / 3600;
@@ -217,18 +1653,19 @@ void *progress_thread(void *arg)
             eta_h = 99;
         }
         /* print beautiful progress information */
-        if (file_list->count_f > 1) {
+        if (multi) {
             if (options->bars) {
                 print_progr_bm(perc_f, perc_t, speed, eta_s, eta_m, eta_h);
             } else {
-                print_progr_pm(perc_f, perc_t, size_str(item->size),
+                print_progr_pm(perc_f, perc_t, size_str(size),
                                size_str(file_list->size), speed, eta_s, eta_m, eta_h);
             }
         } else {
             if (options->bars) {
                 print_progr_bs(perc_f, speed, eta_s, eta_m, eta_h);
             } else {
-                print_progr_ps(perc_f, size_str(item->size), speed, eta_s, eta_m, eta_h);
+                print_progr_ps(perc_f, size_str(size), speed, eta_s, eta_m,
+                               eta_h);
             }
         }
         fflush(stdout);
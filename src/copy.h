@@ -21,11 +21,57 @@
 
 #include "file.h"
 #include "lists.h"
+#include "uring.h"
 
+// growable I/O buffer of a worker, see buffer_reserve()
+typedef struct {
+    char    *data;
+    size_t  size;
+    char    aligned;                    // page-aligned, for O_DIRECT
+} buffer_t;
 
-// copy regular file given as file_t, use supplied buffer for I/O
+// whether given file is copied as concurrent ranges (see --streams)
+#define COPY_SPLIT(file, opts) ((opts)->streams > 1 && \
+                                (file)->size >= SPLIT_MIN)
+
+// whether given file is copied bypassing the page cache (see --direct)
+#define COPY_DIRECT(file, opts) ((opts)->direct_min > 0 && \
+                                 (file)->size >= (opts)->direct_min)
+
+// whether only data segments of given file are copied (see --sparse)
+#define COPY_SPARSE(file, opts) ((opts)->sparse == SPARSE_ALWAYS || \
+                                 ((opts)->sparse == SPARSE_AUTO && \
+                                  (file)->xfer < (file)->size))
+
+// whether an existing destination of given file is updated in place,
+// block by block (see --delta)
+#define COPY_DELTA(file, opts) ((opts)->delta && (file)->size > BUFFS)
+
+// whether data is hashed while copying, which restricts copy_file() to
+// the engines passing it through user space (see --checksum, --verify);
+// parse_opts() rejects the modes this would silently drop
+#define COPY_SUMMED(opts) ((opts)->checksum != NULL || (opts)->verify)
+
+// whether given file needs one of the special engines of copy_file()
+#define COPY_SPECIAL(file, opts) (COPY_SPLIT(file, opts) || \
+                                  COPY_DIRECT(file, opts) || \
+                                  COPY_SPARSE(file, opts) || \
+                                  COPY_DELTA(file, opts) || \
+                                  COPY_SUMMED(opts))
+
+
+// copy regular file given as file_t, use supplied buffer for I/O, which
+// is grown to the I/O size chosen for the file
 int copy_file(file_t *file, flist_t *flist, strlist_t *fail_list, opts_t *opts,
-              char *buffer, unsigned int buff_size);
+              buffer_t *buffer);
+
+// make sure given buffer holds at least 'size' bytes, contents are lost
+int buffer_reserve(buffer_t *buffer, size_t size);
+
+// copy given regular files with their I/O batched through given io_uring,
+// marks successfully copied files as done
+int copy_batch(file_t **files, unsigned int count, flist_t *flist,
+               strlist_t *fail_list, opts_t *opts, uring_t *ring);
 
 // 'copy' directory given as file_t, i.e. create destination directory
 int copy_dir(file_t *file, opts_t *opts, strlist_t *fail_list);
@@ -33,8 +79,21 @@ int copy_dir(file_t *file, opts_t *opts, strlist_t *fail_list);
 // copy symlink given as file_t
 int copy_link(file_t *file, strlist_t *fail_list);
 
-// display transfer progress for given file, threaded
+// recreate given file as hardlink to the destination of its 'link' item,
+// replacing an existing file; fails silently, so the data can be copied
+int copy_hardlink(file_t *file);
+
+// recreate given file as CoW clone of the destination of its 'link' item,
+// with its own attributes; returns -1 if cloning is not possible (silently,
+// so the data can be copied), 1 on other errors
+int copy_reflink(file_t *file, opts_t *opts, strlist_t *fail_list);
+
+// display transfer progress for given file (or whole list if NULL), threaded
 void *progress_thread(void *arg);
 
+// display aggregated progress of concurrent copies until progress_end()
+void progress_begin(flist_t *flist, opts_t *opts);
+void progress_end();
+
 
 #endif
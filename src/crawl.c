@@ -0,0 +1,678 @@
+/* Copyright lynix <lynix47@gmail.com>, 2009, 2010, 2014
+ *
+ * This file is part of vcp (verbose cp).
+ *
+ * vcp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcp. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE         /* fdopendir(), O_PATH                      */
+
+#include "crawl.h"
+#include "helpers.h"
+#include "manifest.h"
+#include "journal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+
+#define DEQUE_INIT 64L
+
+/* directory waiting to be read */
+typedef struct {
+    file_t  *dir;
+    char    dst_check;                  /* destination may exist    */
+} crawl_job_t;
+
+/* per-thread double-ended queue: the owner pushes and pops at the tail,
+ * idle threads steal from the head, i.e. the oldest (largest) subtrees */
+typedef struct {
+    crawl_job_t     *jobs;
+    ulong           head;
+    ulong           tail;
+    ulong           size;
+    pthread_mutex_t lock;
+} deque_t;
+
+typedef struct crawler crawler_t;
+
+/* state of a single crawler thread, results are merged after join */
+typedef struct {
+    crawler_t       *crawler;
+    unsigned int    id;
+    deque_t         deque;
+    flist_t         *list;              /* items to copy            */
+    flist_t         *asks;              /* items waiting for prompt */
+} crawl_thread_t;
+
+struct crawler {
+    crawl_thread_t  *threads;
+    unsigned int    n_threads;
+    opts_t          *opts;
+    pthread_mutex_t lock;               /* protects fields below    */
+    pthread_cond_t  wake;
+    ulong           queued;             /* jobs waiting in deques   */
+    ulong           pending;            /* jobs queued or running   */
+    char            failed;
+    crawl_emit_t    emit;               /* streaming consumer       */
+    void            *arg;
+    flist_t         *file_list;         /* see crawl_item()         */
+};
+
+
+/* append '/name' to given path buffer of PATH_MAX bytes whose current
+ * length is 'len', fails if the result does not fit */
+static int path_cat(char *path, size_t len, char *name)
+{
+    size_t len_n = strlen(name);
+    if (len + len_n + 2 > PATH_MAX) {
+        print_error("path too long: '%s/%s'", path, name);
+        return -1;
+    }
+    path[len] = '/';
+    memcpy(path + len + 1, name, len_n + 1);
+
+    return 0;
+}
+
+/* collect source item, check for existing destination, returns NULL on
+ * error; if the user has to be asked, the destination item is returned
+ * in f_dst, which has to be deleted by the caller.
+ * Items below a parent directory item are looked up by their name relative
+ * to the given directories, others by their full paths. No destination
+ * lookup is done if its directory does not exist (dst_fd < 0). The source
+ * item is allocated from the given arena. Items finished by an interrupted
+ * run are taken from the journal of given list, if any. Destination states
+ * found are recorded in its manifest, if any; if 'trust' is set, their
+ * directory is unchanged since the manifest was saved and its records are
+ * used instead of stat()'ing. */
+static file_t *crawl_item(arena_t *arena, flist_t *file_list, file_t *parent,
+                          int src_fd, int dst_fd, char *src, char *dst,
+                          unsigned char type, opts_t *opts, char trust,
+                          file_t **f_dst)
+{
+    manifest_t *manifest = file_list->manifest;
+    char *name = (parent != NULL) ? path_base(src) : NULL;
+    *f_dst = NULL;
+
+    /* check source access, prepare file struct */
+    file_t *f_src = (parent != NULL) ?
+                    f_new_child(arena, parent, src_fd, name, type) :
+                    f_new_at(arena, src_fd, src, src, dst, type);
+    if (f_src == NULL) {
+        print_error("failed to open '%s': %s", src, strerror(errno));
+        return NULL;
+    }
+
+    /* holes are skipped in sparse mode, only count allocated data */
+    if (opts->sparse != SPARSE_NEVER && f_src->type == RFILE &&
+            f_src->alloc < f_src->size)
+        f_src->xfer = f_src->alloc;
+
+    /* finished or partially copied by an interrupted run (--resume), the
+     * offset is looked up again for copying */
+    off_t offset;
+    int state = (file_list->journal != NULL && f_src->type != RDIR) ?
+                journal_state(file_list->journal, dst, f_src, &offset) :
+                JOURNAL_NONE;
+    if (state == JOURNAL_DONE)
+        f_src->done = 1;
+    if (state != JOURNAL_NONE)
+        return f_src;
+
+    /* collision handling: inaccessible counts as absent */
+    if (dst_fd == -1)
+        return f_src;
+    if (trust && opts->update && manifest_equal(manifest, dst, f_src)) {
+        f_src->done = 1;
+        return f_src;
+    }
+    file_t *f_old = f_new_at(NULL, dst_fd, name ? name : dst, dst, dst,
+                             DT_UNKNOWN);
+    if (f_old == NULL && (errno == ENOENT || errno == ENOTDIR ||
+                          errno == EACCES)) {
+        errno = 0;
+        return f_src;
+    }
+    if (f_old == NULL) {
+        print_error("failed to read '%s': %s", dst, strerror(errno));
+        f_delete(f_src);
+        return NULL;
+    }
+    if (manifest != NULL && manifest_put(manifest, dst, f_old) != 0)
+        print_debug("failed to record '%s' in manifest", dst);
+
+    if ((f_src->type == RDIR) != (f_old->type == RDIR)) {
+        print_error("type mismatch while trying to replace file with directory or vice versa: '%s', '%s'",
+                    src, dst);
+        f_delete(f_src);
+        f_delete(f_old);
+        return NULL;
+    }
+
+    /* resuming: directories are not journaled, as their attributes are
+     * only set at the very end; the interrupted run confirmed them */
+    char resumed = opts->resume && file_list->journal != NULL &&
+                   f_src->type == RDIR;
+    if (opts->keep || (opts->update && f_equal(f_src, f_old))) {
+        f_src->done = 1;
+        f_delete(f_old);
+    } else if (!opts->force && !resumed) {
+        *f_dst = f_old;
+    } else {
+        f_delete(f_old);
+    }
+
+    return f_src;
+}
+
+/* open source directory for reading and the matching destination one for
+ * lookups, the latter is -1 if it does not exist (nor its contents) */
+static DIR *crawl_open(int src_fd, int dst_fd, char *src_name, char *dst_name,
+                       int *sub_dst_fd)
+{
+    int fd = openat(src_fd, src_name, O_RDONLY | O_DIRECTORY);
+    DIR *dir = (fd >= 0) ? fdopendir(fd) : NULL;
+    if (dir == NULL) {
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    *sub_dst_fd = -1;
+    if (dst_fd != -1)
+        *sub_dst_fd = openat(dst_fd, dst_name, O_PATH | O_DIRECTORY);
+    errno = 0;
+
+    return dir;
+}
+
+/* single-threaded depth-first recursion, asks for overwrites right away;
+ * see crawl_item() for the lookup arguments. Paths are PATH_MAX buffers,
+ * extended by the entry names while descending. */
+static int crawl_serial(flist_t *file_list, file_t *parent, int src_fd,
+                        int dst_fd, char *src, char *dst, unsigned char type,
+                        opts_t *opts, char trust)
+{
+    manifest_t *manifest = file_list->manifest;
+    file_t *f_dst;
+    file_t *f_src = crawl_item(file_list->arena, file_list, parent, src_fd,
+                               dst_fd, src, dst, type, opts, trust, &f_dst);
+    if (f_src == NULL)
+        return -1;
+    if (f_dst != NULL) {
+        if (!ask_overwrite(f_dst, f_src))
+            f_src->done = 1;
+        f_delete(f_dst);
+    }
+
+    /* add to copy list */
+    ftype_t f_type = f_src->type;
+    if (f_src->done) {
+        f_delete(f_src);
+    } else if (flist_add(file_list, f_src) != 0) {
+        print_error("unable to add to copy list");
+        f_delete(f_src);
+        return -1;
+    }
+
+    /* advance to recursion only if src is a directory */
+    if (f_type != RDIR)
+        return 0;
+
+    char *name = (parent != NULL) ? path_base(src) : NULL;
+    int sub_dst_fd;
+    DIR *src_dir = crawl_open(src_fd, dst_fd, name ? name : src,
+                              name ? name : dst, &sub_dst_fd);
+    if (src_dir == NULL) {
+        print_error("failed to open directory '%s': %s", src, strerror(errno));
+        return -1;
+    }
+    char sub_trust = sub_dst_fd >= 0 && manifest != NULL &&
+                     manifest_trust(manifest, f_src, sub_dst_fd, dst);
+    int retval = 0;
+    size_t len_src = strlen(src);
+    size_t len_dst = strlen(dst);
+    struct dirent *src_dirp;
+    while ((src_dirp = readdir(src_dir)) != NULL) {
+        /* IMPORTANT: skip '.' and '..' */
+        char *n = src_dirp->d_name;
+        if (n[0] == '.' && (n[1] == '\0' || (n[1] == '.' && n[2] == '\0')))
+            continue;
+
+        /* recursively crawl directory contents; directory items stay valid
+         * as parents, even if not listed */
+        if (path_cat(src, len_src, n) != 0 || path_cat(dst, len_dst, n) != 0)
+            retval = -1;
+        else
+            retval = crawl_serial(file_list, f_src, dirfd(src_dir),
+                                  sub_dst_fd, src, dst, src_dirp->d_type,
+                                  opts, sub_trust);
+        if (retval != 0)
+            break;
+    }
+    src[len_src] = '\0';
+    dst[len_dst] = '\0';
+    closedir(src_dir);
+    if (sub_dst_fd >= 0)
+        close(sub_dst_fd);
+
+    return retval;
+}
+
+static int deque_push(deque_t *deque, crawl_job_t *job)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->size) {
+        /* reuse space freed by thieves before growing */
+        if (deque->head > 0) {
+            memmove(deque->jobs, deque->jobs + deque->head,
+                    (deque->tail - deque->head) * sizeof(crawl_job_t));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        } else {
+            crawl_job_t *jobs = realloc(deque->jobs, deque->size * 2L *
+                                        sizeof(crawl_job_t));
+            if (jobs == NULL) {
+                pthread_mutex_unlock(&deque->lock);
+                print_error("out of memory while crawling");
+                return -1;
+            }
+            deque->jobs = jobs;
+            deque->size *= 2L;
+        }
+    }
+    deque->jobs[deque->tail++] = *job;
+    pthread_mutex_unlock(&deque->lock);
+
+    return 0;
+}
+
+/* take newest job (own deque) or oldest one (stealing) */
+static int deque_take(deque_t *deque, crawl_job_t *job, char steal)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        *job = steal ? deque->jobs[deque->head++] :
+                       deque->jobs[--deque->tail];
+        if (deque->head == deque->tail)
+            deque->head = deque->tail = 0;
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return found;
+}
+
+/* hand out a new directory job, fails if out of memory */
+static int crawl_push(crawl_thread_t *self, file_t *dir, char dst_check)
+{
+    crawler_t *crawler = self->crawler;
+    crawl_job_t job;
+
+    job.dir         = dir;
+    job.dst_check   = dst_check;
+    if (deque_push(&self->deque, &job) != 0)
+        return -1;
+
+    pthread_mutex_lock(&crawler->lock);
+    crawler->queued++;
+    crawler->pending++;
+    pthread_cond_signal(&crawler->wake);
+    pthread_mutex_unlock(&crawler->lock);
+
+    return 0;
+}
+
+/* get next job, from own deque first, else from others; returns 0 if the
+ * whole tree has been crawled or crawling failed */
+static int crawl_next(crawl_thread_t *self, crawl_job_t *job)
+{
+    crawler_t *crawler = self->crawler;
+
+    while (1) {
+        int found = deque_take(&self->deque, job, 0);
+        for (unsigned int i = 1; !found && i < crawler->n_threads; i++) {
+            unsigned int victim = (self->id + i) % crawler->n_threads;
+            found = deque_take(&crawler->threads[victim].deque, job, 1);
+        }
+
+        pthread_mutex_lock(&crawler->lock);
+        if (found) {
+            crawler->queued--;
+            pthread_mutex_unlock(&crawler->lock);
+            return 1;
+        }
+        /* nothing visible: wait for new jobs or the end */
+        while (crawler->queued == 0 && crawler->pending > 0 &&
+               !crawler->failed)
+            pthread_cond_wait(&crawler->wake, &crawler->lock);
+        int stop = crawler->pending == 0 || crawler->failed;
+        pthread_mutex_unlock(&crawler->lock);
+        if (stop)
+            return 0;
+    }
+}
+
+/* read given directory, sort entries into own lists, queue subdirectories */
+static int crawl_dir(crawl_thread_t *self, crawl_job_t *job)
+{
+    opts_t *opts = self->crawler->opts;
+    char sub_src[PATH_MAX];
+    char sub_dst[PATH_MAX];
+    size_t len_src = strlen(f_src_path(job->dir, sub_src));
+    size_t len_dst = strlen(f_dst_path(job->dir, sub_dst));
+
+    int dst_fd;
+    DIR *src_dir = crawl_open(AT_FDCWD, job->dst_check ? AT_FDCWD : -1,
+                              sub_src, sub_dst, &dst_fd);
+    if (src_dir == NULL) {
+        print_error("failed to open directory '%s': %s", sub_src,
+                    strerror(errno));
+        return -1;
+    }
+    manifest_t *manifest = self->crawler->file_list->manifest;
+    char trust = dst_fd >= 0 && manifest != NULL &&
+                 manifest_trust(manifest, job->dir, dst_fd, sub_dst);
+
+    int retval = 0;
+    struct dirent *src_dirp;
+    while ((src_dirp = readdir(src_dir)) != NULL) {
+        char *n = src_dirp->d_name;
+        if (n[0] == '.' && (n[1] == '\0' || (n[1] == '.' && n[2] == '\0')))
+            continue;
+
+        if (path_cat(sub_src, len_src, n) != 0 ||
+                path_cat(sub_dst, len_dst, n) != 0) {
+            retval = -1;
+            break;
+        }
+        file_t *f_dst;
+        file_t *f_src = crawl_item(self->list->arena,
+                                   self->crawler->file_list, job->dir,
+                                   dirfd(src_dir), dst_fd, sub_src, sub_dst,
+                                   src_dirp->d_type, opts, trust, &f_dst);
+        ftype_t type = RFILE;
+        if (f_src == NULL) {
+            retval = -1;
+        } else {
+            type = f_src->type;
+            if (f_src->done) {
+                f_delete(f_src);
+            } else if (f_dst != NULL) {
+                /* prompts are deferred until all threads are done */
+                f_delete(f_dst);
+                retval = flist_add(self->asks, f_src);
+            } else if (self->crawler->emit != NULL) {
+                retval = self->crawler->emit(f_src, self->crawler->arg);
+            } else {
+                retval = flist_add(self->list, f_src);
+            }
+            if (retval != 0) {
+                print_error("unable to add to copy list");
+                f_delete(f_src);
+            }
+        }
+
+        /* directory items stay valid as parents, even if not listed */
+        if (retval == 0 && type == RDIR)
+            retval = crawl_push(self, f_src, dst_fd >= 0);
+        if (retval != 0)
+            break;
+    }
+    closedir(src_dir);
+    if (dst_fd >= 0)
+        close(dst_fd);
+
+    return retval;
+}
+
+static void *crawl_thread(void *arg)
+{
+    crawl_thread_t *self = (crawl_thread_t *)arg;
+    crawler_t *crawler = self->crawler;
+    crawl_job_t job;
+
+    while (crawl_next(self, &job)) {
+        int ret = crawl_dir(self, &job);
+
+        pthread_mutex_lock(&crawler->lock);
+        if (ret != 0)
+            crawler->failed = 1;
+        crawler->pending--;
+        if (crawler->pending == 0 || crawler->failed)
+            pthread_cond_broadcast(&crawler->wake);
+        pthread_mutex_unlock(&crawler->lock);
+    }
+
+    return NULL;
+}
+
+/* move items of given thread-local list to given list */
+static int crawl_merge(flist_t *list, flist_t *from)
+{
+    for (ulong i = 0; i < from->count; i++) {
+        if (flist_add(list, from->items[i]) != 0) {
+            /* remaining items stay with the source list */
+            memmove(from->items, from->items + i,
+                    (from->count - i) * sizeof(file_t *));
+            from->count -= i;
+            return -1;
+        }
+    }
+    from->count = 0;
+
+    return 0;
+}
+
+int crawl_asks(flist_t *file_list, flist_t *asks)
+{
+    if (asks->count == 0)
+        return 0;
+    if (flist_shrink(asks) != 0)
+        return -1;
+    flist_sort(asks);
+
+    for (ulong i = 0; i < asks->count; i++) {
+        file_t *f_src = asks->items[i];
+        char dst[PATH_MAX];
+        f_dst_path(f_src, dst);
+        file_t *f_dst = f_new(dst, dst);
+
+        /* vanished in the meantime: nothing to ask */
+        if (f_dst != NULL) {
+            if (!ask_overwrite(f_dst, f_src))
+                f_src->done = 1;
+            f_delete(f_dst);
+        }
+        errno = 0;
+
+        if (f_src->done) {
+            f_delete(f_src);
+        } else if (flist_add(file_list, f_src) != 0) {
+            print_error("unable to add to copy list");
+            f_delete(f_src);
+            /* remaining items stay with the ask list */
+            memmove(asks->items, asks->items + i + 1,
+                    (asks->count - i - 1) * sizeof(file_t *));
+            asks->count -= i + 1;
+            return -1;
+        }
+    }
+    asks->count = 0;
+
+    return 0;
+}
+
+/* crawl contents of given directory by several threads taking directories
+ * from each others' deques, results are merged in the end or, if 'emit' is
+ * given, passed on right away; prompts are left in 'asks_out' then */
+static int crawl_parallel(flist_t *file_list, char *src, char *dst,
+                          opts_t *opts, crawl_emit_t emit, void *arg,
+                          flist_t *asks_out)
+{
+    /* root item is handled like in serial mode, unless streaming */
+    file_t *f_dst;
+    file_t *f_src = crawl_item(file_list->arena, file_list, NULL, AT_FDCWD,
+                               AT_FDCWD, src, dst, DT_UNKNOWN, opts, 0,
+                               &f_dst);
+    if (f_src == NULL)
+        return -1;
+    if (f_dst != NULL && emit == NULL) {
+        if (!ask_overwrite(f_dst, f_src))
+            f_src->done = 1;
+        f_delete(f_dst);
+        f_dst = NULL;
+    }
+    ftype_t type = f_src->type;
+    int retval = 0;
+    if (f_src->done)
+        f_delete(f_src);
+    else if (f_dst != NULL)
+        retval = flist_add(asks_out, f_src);
+    else if (emit != NULL)
+        retval = emit(f_src, arg);
+    else
+        retval = flist_add(file_list, f_src);
+    if (f_dst != NULL)
+        f_delete(f_dst);
+    if (retval != 0) {
+        print_error("unable to add to copy list");
+        f_delete(f_src);
+        return -1;
+    }
+    if (type != RDIR)
+        return 0;
+
+    /* set up threads, calling one is the first */
+    crawler_t crawler;
+    crawler.n_threads   = opts->crawl_threads;
+    crawler.opts        = opts;
+    crawler.queued      = 0;
+    crawler.pending     = 0;
+    crawler.failed      = 0;
+    crawler.emit        = emit;
+    crawler.arg         = arg;
+    crawler.file_list   = file_list;
+    crawler.threads     = calloc(crawler.n_threads, sizeof(crawl_thread_t));
+    flist_t *asks = flist_new();
+    if (crawler.threads == NULL || asks == NULL) {
+        print_error("failed to set up crawler threads");
+        free(crawler.threads);
+        if (asks != NULL)
+            flist_delete(asks);
+        return -1;
+    }
+    pthread_mutex_init(&crawler.lock, NULL);
+    pthread_cond_init(&crawler.wake, NULL);
+    for (unsigned int i = 0; i < crawler.n_threads; i++) {
+        crawl_thread_t *t = &crawler.threads[i];
+        t->crawler      = &crawler;
+        t->id           = i;
+        t->deque.jobs   = malloc(DEQUE_INIT * sizeof(crawl_job_t));
+        t->deque.head   = 0;
+        t->deque.tail   = 0;
+        t->deque.size   = DEQUE_INIT;
+        t->list         = flist_new();
+        t->asks         = flist_new();
+        pthread_mutex_init(&t->deque.lock, NULL);
+        if (t->deque.jobs == NULL || t->list == NULL || t->asks == NULL)
+            crawler.failed = 1;
+    }
+
+    pthread_t *tids = malloc(crawler.n_threads * sizeof(pthread_t));
+    unsigned int n_spawned = 1;
+    if (tids == NULL || crawler.failed || crawl_push(&crawler.threads[0],
+            f_src, 1) != 0) {
+        print_error("failed to set up crawler threads");
+        crawler.failed = 1;
+    } else {
+        while (n_spawned < crawler.n_threads) {
+            if (pthread_create(&tids[n_spawned], NULL, crawl_thread,
+                               &crawler.threads[n_spawned]) != 0)
+                break;
+            n_spawned++;
+        }
+        print_debug("crawling '%s' by %u threads", src, n_spawned);
+        crawl_thread(&crawler.threads[0]);
+        for (unsigned int i = 1; i < n_spawned; i++)
+            pthread_join(tids[i], NULL);
+    }
+    free(tids);
+
+    /* merge results and the memory they live in, clean up */
+    retval = crawler.failed ? -1 : 0;
+    for (unsigned int i = 0; i < crawler.n_threads; i++) {
+        crawl_thread_t *t = &crawler.threads[i];
+        if (retval == 0 && (crawl_merge(file_list, t->list) != 0 ||
+                            crawl_merge(asks, t->asks) != 0)) {
+            print_error("unable to add to copy list");
+            retval = -1;
+        }
+        if (t->list != NULL) {
+            arena_merge(file_list->arena, t->list->arena);
+            flist_delete(t->list);
+        }
+        if (t->asks != NULL) {
+            arena_merge(file_list->arena, t->asks->arena);
+            flist_delete(t->asks);
+        }
+        free(t->deque.jobs);
+        pthread_mutex_destroy(&t->deque.lock);
+    }
+    free(crawler.threads);
+    pthread_mutex_destroy(&crawler.lock);
+    pthread_cond_destroy(&crawler.wake);
+
+    if (retval == 0 && emit != NULL && crawl_merge(asks_out, asks) != 0) {
+        print_error("unable to add to copy list");
+        retval = -1;
+    } else if (retval == 0 && emit == NULL) {
+        retval = crawl_asks(file_list, asks);
+    }
+    flist_delete(asks);
+
+    return retval;
+}
+
+int crawl(flist_t *file_list, char *src, char *dst, opts_t *opts)
+{
+    if (opts->crawl_threads > 1)
+        return crawl_parallel(file_list, src, dst, opts, NULL, NULL, NULL);
+
+    char buf_src[PATH_MAX];
+    char buf_dst[PATH_MAX];
+    if (strlen(src) >= PATH_MAX || strlen(dst) >= PATH_MAX) {
+        print_error("path too long: '%s'", src);
+        return -1;
+    }
+    strcpy(buf_src, src);
+    strcpy(buf_dst, dst);
+
+    return crawl_serial(file_list, NULL, AT_FDCWD, AT_FDCWD, buf_src,
+                        buf_dst, DT_UNKNOWN, opts, 0);
+}
+
+int crawl_stream(flist_t *file_list, char *src, char *dst, opts_t *opts,
+                 crawl_emit_t emit, void *arg, flist_t *asks)
+{
+    return crawl_parallel(file_list, src, dst, opts, emit, arg, asks);
+}
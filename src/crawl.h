@@ -0,0 +1,47 @@
+/* Copyright lynix <lynix47@gmail.com>, 2009, 2010, 2014
+ *
+ * This file is part of vcp (verbose cp).
+ *
+ * vcp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcp. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CRAWL_H
+#define _CRAWL_H
+
+#include "lists.h"
+#include "options.h"
+
+
+// consumer of crawled items in streaming mode, takes over the item unless
+// it fails
+typedef int (*crawl_emit_t)(file_t *item, void *arg);
+
+// collect given source item and, if it is a directory, its contents
+// recursively into given list, by several threads if requested; with a
+// manifest set on the list, destination states are recorded in it and
+// taken from it for unchanged directories (see manifest_trust()); with a
+// journal, items finished by an interrupted run are skipped
+int crawl(flist_t *file_list, char *src, char *dst, opts_t *opts);
+
+// like crawl(), but pass items on as soon as they are found; items waiting
+// for an overwrite prompt are collected in 'asks' instead. Items are still
+// allocated from the arena of given list.
+int crawl_stream(flist_t *file_list, char *src, char *dst, opts_t *opts,
+                 crawl_emit_t emit, void *arg, flist_t *asks);
+
+// ask about overwriting the items collected by crawl_stream() in
+// destination order, move confirmed ones to given list
+int crawl_asks(flist_t *file_list, flist_t *asks);
+
+#endif
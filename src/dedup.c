@@ -0,0 +1,239 @@
+/* Copyright lynix <lynix47@gmail.com>, 2009, 2010, 2014
+ *
+ * This file is part of vcp (verbose cp).
+ *
+ * vcp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcp. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "dedup.h"
+#include "hash.h"
+#include "helpers.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define DEDUP_READ 1048576  /* read size for full content hashes        */
+
+/* what the candidates of a group have in common */
+#define STAGE_SIZE  0
+#define STAGE_EDGES 1       /* hash of first and last block             */
+#define STAGE_FULL  2       /* hash of all content                      */
+
+/* file that may have duplicates */
+typedef struct {
+    file_t      *item;
+    uint64_t    key;                    /* size, then content hash  */
+    ulong       pos;                    /* list order               */
+    char        failed;                 /* unreadable, left alone   */
+} cand_t;
+
+static int cand_cmpr(const void *a, const void *b)
+{
+    const cand_t *cand_a = (const cand_t *)a;
+    const cand_t *cand_b = (const cand_t *)b;
+
+    /* unreadable ones go last */
+    if (cand_a->failed != cand_b->failed)
+        return cand_a->failed - cand_b->failed;
+    if (cand_a->key != cand_b->key)
+        return (cand_a->key < cand_b->key) ? -1 : 1;
+
+    return (cand_a->pos < cand_b->pos) ? -1 : (cand_a->pos > cand_b->pos);
+}
+
+/* hash given byte range of given file into state */
+static int hash_range(int fd, off_t off, off_t len, char *buffer,
+                      xxh64_t *state)
+{
+    while (len > 0) {
+        size_t n = (len > DEDUP_READ) ? DEDUP_READ : len;
+        ssize_t r = pread(fd, buffer, n, off);
+        if (r <= 0)
+            return -1;
+        xxh64_update(state, buffer, r);
+        off += r;
+        len -= r;
+    }
+
+    return 0;
+}
+
+/* replace key of given candidate by a content hash: of the whole file or
+ * its first and last block only */
+static void cand_hash(cand_t *cand, char full, char *buffer)
+{
+    char src[PATH_MAX];
+    off_t size = cand->item->size;
+    xxh64_t state;
+
+    int fd = open(f_src_path(cand->item, src), O_RDONLY);
+    if (fd < 0) {
+        cand->failed = 1;
+        return;
+    }
+
+    xxh64_init(&state, 0);
+    int ret;
+    if (full || size <= 2 * DEDUP_BLOCK) {
+        ret = hash_range(fd, 0, size, buffer, &state);
+    } else {
+        ret = hash_range(fd, 0, DEDUP_BLOCK, buffer, &state);
+        if (ret == 0)
+            ret = hash_range(fd, size - DEDUP_BLOCK, DEDUP_BLOCK, buffer,
+                             &state);
+    }
+    close(fd);
+
+    cand->key = xxh64_digest(&state);
+    cand->failed = ret != 0;
+}
+
+/* compare contents of given candidates byte by byte, equal hashes are no
+ * proof; uses both halves of given buffer */
+static int cand_same(cand_t *a, cand_t *b, char *buffer)
+{
+    char src[PATH_MAX];
+    size_t half = DEDUP_READ / 2;
+
+    int fd_a = open(f_src_path(a->item, src), O_RDONLY);
+    int fd_b = open(f_src_path(b->item, src), O_RDONLY);
+    int same = fd_a >= 0 && fd_b >= 0;
+    for (off_t off = 0; same && off < a->item->size; ) {
+        size_t n = (a->item->size - off > (off_t)half) ? half :
+                   (size_t)(a->item->size - off);
+        ssize_t r = pread(fd_a, buffer, n, off);
+        if (r <= 0 || pread(fd_b, buffer + half, r, off) != r ||
+                memcmp(buffer, buffer + half, r) != 0)
+            same = 0;
+        off += r;
+    }
+    if (fd_a >= 0)
+        close(fd_a);
+    if (fd_b >= 0)
+        close(fd_b);
+
+    return same;
+}
+
+/* whether given files could share an inode, i.e. their attributes */
+static int same_attrs(file_t *a, file_t *b)
+{
+    return a->uid == b->uid && a->gid == b->gid && a->mode == b->mode &&
+           a->times.modtime == b->times.modtime;
+}
+
+/* length of the run of candidates with equal key at given one */
+static ulong cand_run(cand_t *cands, ulong start, ulong count)
+{
+    ulong end = start + 1;
+    while (end < count && cands[end].key == cands[start].key &&
+           cands[end].failed == cands[start].failed)
+        end++;
+
+    return end - start;
+}
+
+/* split given group of candidates sharing the key of given stage by the
+ * key of the next one, link the duplicates once their full contents match;
+ * returns number of duplicates */
+static long dedup_group(flist_t *list, cand_t *cands, ulong count, int stage,
+                        dedup_t mode, char *buffer)
+{
+    if (stage == STAGE_FULL) {
+        /* keep the first one in list order, link the others; hardlinks
+         * need equal attributes, reflinks keep their own */
+        long found = 0;
+        for (ulong i = 1; i < count; i++) {
+            file_t *item = cands[i].item;
+            for (ulong k = 0; k < i; k++) {
+                file_t *first = cands[k].item;
+                if (first->link != NULL ||
+                        (mode == DEDUP_LINK && !same_attrs(first, item)))
+                    continue;
+                if (cand_same(&cands[k], &cands[i], buffer)) {
+                    item->link = first;
+                    list->size -= item->xfer;
+                    item->xfer = 0;
+                    found++;
+                }
+                break;
+            }
+        }
+        return found;
+    }
+
+    /* small files are hashed completely right away */
+    char full = stage == STAGE_EDGES ||
+                cands[0].item->size <= 2 * DEDUP_BLOCK;
+    for (ulong i = 0; i < count; i++)
+        cand_hash(&cands[i], full, buffer);
+    qsort(cands, count, sizeof(cand_t), cand_cmpr);
+
+    long found = 0;
+    for (ulong i = 0; i < count && !cands[i].failed; ) {
+        ulong run = cand_run(cands, i, count);
+        if (run > 1)
+            found += dedup_group(list, cands + i, run,
+                                 full ? STAGE_FULL : STAGE_EDGES, mode,
+                                 buffer);
+        i += run;
+    }
+
+    return found;
+}
+
+long dedup_list(flist_t *list, dedup_t mode)
+{
+    /* candidates: regular files still to copy, not hardlinked anyway */
+    cand_t *cands = malloc(list->count * sizeof(cand_t) + 1);
+    char *buffer = malloc(DEDUP_READ);
+    if (cands == NULL || buffer == NULL) {
+        free(cands);
+        free(buffer);
+        return -1;
+    }
+    ulong count = 0;
+    for (ulong i = 0; i < list->count; i++) {
+        file_t *item = list->items[i];
+        if (item->type != RFILE || item->done || item->link != NULL ||
+                item->size == 0)
+            continue;
+        cands[count].item   = item;
+        cands[count].key    = item->size;
+        cands[count].pos    = i;
+        cands[count].failed = 0;
+        count++;
+    }
+
+    /* first stage: equal size */
+    qsort(cands, count, sizeof(cand_t), cand_cmpr);
+    long found = 0;
+    for (ulong i = 0; i < count; ) {
+        ulong run = cand_run(cands, i, count);
+        if (run > 1)
+            found += dedup_group(list, cands + i, run, STAGE_SIZE, mode,
+                                 buffer);
+        i += run;
+    }
+    free(cands);
+    free(buffer);
+
+    print_debug("found %ld duplicate(s) by content", found);
+
+    return found;
+}
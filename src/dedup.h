@@ -0,0 +1,34 @@
+/* Copyright lynix <lynix47@gmail.com>, 2009, 2010, 2014
+ *
+ * This file is part of vcp (verbose cp).
+ *
+ * vcp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcp. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include "lists.h"
+
+
+// find regular files of identical content in given list: grouped by size,
+// then by a hash of their first and last block, then by a hash of all of
+// it, and compared byte by byte at last; duplicates are linked to the first
+// item (see file_t) and do not count for transfer size any more. With
+// DEDUP_LINK, owner, mode and mtime have to match as well. Returns the
+// number of duplicates, -1 if out of memory.
+long dedup_list(flist_t *list, dedup_t mode);
+
+#endif
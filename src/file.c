@@ -16,6 +16,8 @@
  * along with vcp. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE                     /* statx()                  */
+
 #include "file.h"
 #include "helpers.h"
 
@@ -25,87 +27,246 @@
 #include <unistd.h>                     /* F_OK                     */
 #include <string.h>                     /* strcmp()                 */
 #include <errno.h>                      /* clear errno if !F_OK     */
+#include <fcntl.h>                      /* AT_FDCWD, fstatat()      */
+#include <dirent.h>                     /* DT_* type hints          */
+#include <limits.h>                     /* PATH_MAX                 */
+#include <sys/ioctl.h>                  /* ioctl()                  */
+#include <linux/fs.h>                   /* FS_IOC_FIEMAP            */
+#include <linux/fiemap.h>               /* struct fiemap            */
+#include <sys/sysmacros.h>              /* makedev()                */
+
 
+/* single stat of given directory entry without following symlinks, only
+ * the fields needed for file_t are requested */
+static int f_stat(int dirfd, char *name, struct stat *st)
+{
+#ifdef STATX_TYPE
+    static char no_statx;
+    struct statx stx;
+
+    if (!no_statx) {
+        unsigned int mask = STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID |
+                            STATX_ATIME | STATX_MTIME | STATX_SIZE |
+                            STATX_BLOCKS | STATX_INO | STATX_NLINK;
+        if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_SYNC_AS_STAT,
+                  mask, &stx) == 0) {
+            st->st_mode     = stx.stx_mode;
+            st->st_uid      = stx.stx_uid;
+            st->st_gid      = stx.stx_gid;
+            st->st_atime    = stx.stx_atime.tv_sec;
+            st->st_mtime    = stx.stx_mtime.tv_sec;
+            st->st_size     = stx.stx_size;
+            st->st_blocks   = stx.stx_blocks;
+            st->st_ino      = stx.stx_ino;
+            st->st_nlink    = stx.stx_nlink;
+            st->st_dev      = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+            return 0;
+        }
+        if (errno != ENOSYS)
+            return -1;
+        no_statx = 1;
+    }
+#endif
+
+    return fstatat(dirfd, name, st, AT_SYMLINK_NOFOLLOW);
+}
 
 file_t *f_new(char *src, char *dst)
 {
-    if (access(src, F_OK) != 0)
+    return f_new_at(NULL, AT_FDCWD, src, src, dst, DT_UNKNOWN);
+}
+
+/* copy string into given arena, or onto the heap if none */
+static char *f_strdup(arena_t *arena, const char *str)
+{
+    return (arena != NULL) ? arena_strdup(arena, str) : strdup(str);
+}
+
+/* stat given directory entry and set up a file_t object without any path
+ * information, see f_new_at() */
+static file_t *f_create(arena_t *arena, int dirfd, char *name,
+                        unsigned char type)
+{
+    /* other object types are not supported anyway */
+    if (type != DT_UNKNOWN && type != DT_REG && type != DT_DIR &&
+            type != DT_LNK) {
+        errno = ENOTSUP;
         return NULL;
+    }
 
-    /* determine file type, collect attributes */
+    /* determine file type, collect attributes; symlinks need none */
     struct stat fstat;
-    if (lstat(src, &fstat) != 0)
+    if (type == DT_LNK)
+        fstat.st_mode = S_IFLNK;
+    else if (f_stat(dirfd, name, &fstat) != 0)
+        return NULL;
+
+    /* symlink: read target, targets are limited to PATH_MAX */
+    char target[PATH_MAX];
+    if (S_ISLNK(fstat.st_mode)) {
+        ssize_t len = readlinkat(dirfd, name, target, sizeof(target));
+        if (len < 0 || len == sizeof(target))
+            return NULL;
+        target[len] = '\0';
+    } else if (!S_ISREG(fstat.st_mode) && !S_ISDIR(fstat.st_mode)) {
+        /* unknown object, abort */
+        errno = ENOTSUP;
         return NULL;
+    }
 
     /* create file_t object */
-    file_t *f_item = malloc(sizeof(file_t));
-    if (f_item == NULL)
+    file_t *f_item = (arena != NULL) ? arena_alloc(arena, sizeof(file_t)) :
+                                       malloc(sizeof(file_t));
+    if (f_item == NULL) {
+        errno = ENOMEM;
         return NULL;
+    }
 
     /* fill type-independent fields */
-    f_item->dst     = (dst != NULL) ? strdup(dst) : NULL;
+    f_item->fname   = NULL;
+    f_item->src     = NULL;
+    f_item->dst     = NULL;
     f_item->ldst    = NULL;
+    f_item->parent  = NULL;
+    f_item->child   = NULL;
+    f_item->next    = NULL;
+    f_item->walk    = 0;
     f_item->size    = 0;
+    f_item->alloc   = 0;
+    f_item->xfer    = 0;
     f_item->uid     = 0;
     f_item->gid     = 0;
     f_item->mode    = 0;
+    f_item->dev     = 0;
+    f_item->ino     = 0;
+    f_item->nlink   = 0;
+    f_item->link    = NULL;
+    f_item->sum     = 0;
     f_item->done    = 0;
-    f_item->src     = strdup(src);
-    f_item->fname   = strdup(path_base(f_item->src));
+    f_item->pooled  = arena != NULL;
 
     /* fill type-dependent fields */
     if (S_ISLNK(fstat.st_mode)) {
-        /* symlink: read target */
         f_item->type    = SLINK;
-        f_item->ldst    = malloc(fstat.st_size + 1);
-        if (readlink(src, f_item->ldst, fstat.st_size) != fstat.st_size) {
-            free(f_item->src);
-            free(f_item->fname);
-            free(f_item->ldst);
-            free(f_item);
+        f_item->ldst    = f_strdup(arena, target);
+        if (f_item->ldst == NULL) {
+            f_delete(f_item);
+            errno = ENOMEM;
             return NULL;
         }
-        f_item->ldst[fstat.st_size] = '\0';
     } else {
-        /* POSIX: uid, modes etc. not defined by lstat(), use stat() */
-        if (stat(src, &fstat) != 0) {
-            free(f_item->src);
-            free(f_item->fname);
-            free(f_item);
-            return NULL;
-        }
+        /* lstat() data of non-links is complete on Linux, no stat() */
         f_item->uid             = fstat.st_uid;
         f_item->gid             = fstat.st_gid;
         f_item->mode            = fstat.st_mode;
         f_item->times.actime    = fstat.st_atime;
         f_item->times.modtime   = fstat.st_mtime;
+        f_item->dev             = fstat.st_dev;
+        f_item->ino             = fstat.st_ino;
+        f_item->nlink           = fstat.st_nlink;
         if (S_ISREG(fstat.st_mode)) {
             /* regular file */
-            f_item->type = RFILE;
-            f_item->size = fstat.st_size;
-        } else if (S_ISDIR(fstat.st_mode)) {
+            f_item->type  = RFILE;
+            f_item->size  = fstat.st_size;
+            f_item->alloc = fstat.st_blocks * 512;
+            f_item->xfer  = fstat.st_size;
+        } else {
             /* directory */
             f_item->type = RDIR;
-        } else {
-            /* unknown object, abort */
-            free(f_item->src);
-            free(f_item->fname);
-            free(f_item);
-            return NULL;
         }
     }
 
     return f_item;
 }
 
+file_t *f_new_at(arena_t *arena, int dirfd, char *name, char *src, char *dst,
+                 unsigned char type)
+{
+    file_t *f_item = f_create(arena, dirfd, name, type);
+    if (f_item == NULL)
+        return NULL;
+
+    f_item->src     = f_strdup(arena, src);
+    f_item->dst     = (dst != NULL) ? f_strdup(arena, dst) : NULL;
+    f_item->fname   = (f_item->src != NULL) ? path_base(f_item->src) : NULL;
+    if (f_item->src == NULL || (dst != NULL && f_item->dst == NULL)) {
+        f_delete(f_item);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return f_item;
+}
+
+file_t *f_new_child(arena_t *arena, file_t *parent, int dirfd, char *name,
+                    unsigned char type)
+{
+    file_t *f_item = f_create(arena, dirfd, name, type);
+    if (f_item == NULL)
+        return NULL;
+
+    f_item->parent  = parent;
+    f_item->fname   = f_strdup(arena, name);
+    if (f_item->fname == NULL) {
+        f_delete(f_item);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return f_item;
+}
+
+/* write path of given item into given buffer of PATH_MAX bytes by walking
+ * up to its root, returns the length */
+static size_t f_path(file_t *item, char *buf, char dst)
+{
+    if (item->parent == NULL) {
+        char *path = dst ? item->dst : item->src;
+        size_t len = strlen(path);
+        if (len >= PATH_MAX)
+            len = PATH_MAX - 1;
+        memcpy(buf, path, len);
+        buf[len] = '\0';
+        return len;
+    }
+
+    /* lengths have been checked while crawling, truncate just in case */
+    size_t len = f_path(item->parent, buf, dst);
+    size_t len_n = strlen(item->fname);
+    if (len + len_n + 2 > PATH_MAX)
+        return len;
+    buf[len] = '/';
+    memcpy(buf + len + 1, item->fname, len_n + 1);
+
+    return len + len_n + 1;
+}
+
+char *f_src_path(file_t *item, char *buf)
+{
+    f_path(item, buf, 0);
+
+    return buf;
+}
+
+char *f_dst_path(file_t *item, char *buf)
+{
+    f_path(item, buf, 1);
+
+    return buf;
+}
+
 void f_delete(file_t *file)
 {
+    /* arena items are freed together with their arena */
+    if (file->pooled)
+        return;
+
+    /* name of root items points into their source path */
+    if (file->parent != NULL)
+        free(file->fname);
     free(file->src);
-    if (file->dst != NULL)
-        free(file->dst);
-    if (file->ldst != NULL)
-        free(file->ldst);
-    free(file->fname);
+    free(file->dst);
+    free(file->ldst);
 
     free(file);
 }
@@ -135,35 +296,55 @@ int f_equal(file_t *a, file_t *b)
     return 1;
 }
 
+int f_extent(file_t *item, uint64_t *physical)
+{
+    char src[PATH_MAX];
+    int fd = open(f_src_path(item, src), O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    /* room for a single extent, no flexible array member in a struct */
+    uint64_t buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) /
+                 sizeof(uint64_t) + 1];
+    struct fiemap *map = (struct fiemap *)buf;
+    memset(buf, 0, sizeof(buf));
+    map->fm_length          = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count    = 1;
+
+    int ret = ioctl(fd, FS_IOC_FIEMAP, map);
+    close(fd);
+    /* delayed allocation has no position yet */
+    if (ret != 0 || map->fm_mapped_extents == 0 ||
+            (map->fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN))
+        return -1;
+    *physical = map->fm_extents[0].fe_physical;
+
+    return 0;
+}
+
 int f_clone_attrs(file_t *item)
 {
     int retval = 0;
+    char dst[PATH_MAX];
+    f_dst_path(item, dst);
 
     /* set owner uid/gid */
-    if (chown(item->dst, item->uid, item->gid) != 0) {
+    if (chown(dst, item->uid, item->gid) != 0) {
         print_debug("failed to set uid/gid");
         retval = -1;
     }
 
     /* set mode */
-    if (chmod(item->dst, item->mode) != 0) {
+    if (chmod(dst, item->mode) != 0) {
         print_debug("failed to set mode");
         retval = -1;
     }
 
     /* set atime/mtime */
-    if (utime(item->dst, &(item->times)) != 0) {
+    if (utime(dst, &(item->times)) != 0) {
         print_debug("failed to set atime/mtime");
         retval = -1;
     }
 
     return retval;
 }
-
-int f_cmpr_dst(const void *a, const void *b)
-{
-    file_t *file_a = *(file_t **)a;
-    file_t *file_b = *(file_t **)b;
-
-    return strcmp(file_a->dst, file_b->dst);
-}
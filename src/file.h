@@ -19,41 +19,84 @@
 #ifndef _FILE_H
 #define _FILE_H
 
+#ifndef _XOPEN_SOURCE
 #define _XOPEN_SOURCE 500
+#endif
 
 #include <sys/types.h>                  // uid_t, gid_t, etc.
 #include <utime.h>                      // struct utimbuf
+#include <stdint.h>                     // uint64_t
+
+#include "arena.h"
 
 typedef enum { RFILE, RDIR, SLINK } ftype_t;
 
-typedef struct {
-    char    *fname;
-    char    *src;
+typedef struct file file_t;
+
+// items below a crawled directory only store their name and a link to the
+// directory item, full paths are built on demand (see f_src_path())
+struct file {
+    char    *fname;                     // name within parent directory
+    char    *src;                       // full paths, only without parent
     char    *dst;
     char    *ldst;
+    file_t  *parent;                    // directory item, or NULL
+    file_t  *child;                     // tree walk state, see flist_sort()
+    file_t  *next;
+    char    walk;
     ftype_t type;
     off_t   size;
+    off_t   alloc;                      // bytes allocated on disk
+    off_t   xfer;                       // bytes to transfer
     uid_t   uid;
     gid_t   gid;
     mode_t  mode;
+    dev_t   dev;                        // source device and inode
+    ino_t   ino;
+    nlink_t nlink;
+    file_t  *link;                      // hardlink to item copied before
+    uint64_t sum;                       // XXH64 of data (--checksum)
     struct  utimbuf times;
     char    done;
-} file_t;
+    char    pooled;                     // allocated from an arena
+};
+
+
+// whether given items share their source inode, i.e. an item linked to
+// another one is a hardlink rather than a duplicate (see dedup_list())
+#define F_SAME_INODE(a, b) ((a)->dev == (b)->dev && (a)->ino == (b)->ino)
 
 
 // create file_t struct from given source and destination paths
 file_t *f_new(char *src, char *dst);
 
-// delete given file_t struct
+// create file_t struct for entry 'name' of directory open as 'dirfd', with
+// a single stat at most; 'type' is the d_type from readdir() or DT_UNKNOWN;
+// record and strings are taken from given arena, or the heap if NULL
+file_t *f_new_at(arena_t *arena, int dirfd, char *name, char *src, char *dst,
+                 unsigned char type);
+
+// like f_new_at(), but for entry 'name' of given directory item, which has
+// to outlive the new one
+file_t *f_new_child(arena_t *arena, file_t *parent, int dirfd, char *name,
+                    unsigned char type);
+
+// build source or destination path of given item into given buffer of
+// PATH_MAX bytes, returns the buffer
+char    *f_src_path(file_t *item, char *buf);
+char    *f_dst_path(file_t *item, char *buf);
+
+// delete given file_t struct (no-op for arena items)
 void    f_delete(file_t *file);
 
+// get physical position of the first extent of given item's source data
+// (FIEMAP), fails if unsupported or there is none
+int     f_extent(file_t *item, uint64_t *physical);
+
 // compare given files regarding size, owner and timestamps
 int     f_equal(file_t *a, file_t *b);
 
 // transfer file attributes from source to destination on given item
 int     f_clone_attrs(file_t *item);
 
-// file_t comparator implementation for qsort()
-int     f_cmpr_dst(const void *a, const void *b);
-
 #endif
@@ -0,0 +1,236 @@
+/* Copyright lynix <lynix47@gmail.com>, 2009, 2010, 2014
+ *
+ * This file is part of vcp (verbose cp).
+ *
+ * vcp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcp. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "hash.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+#define FNV_PRIME 1099511628211ULL
+#define MIX_PRIME 0x9e3779b97f4a7c15ULL     /* 2^64 / golden ratio      */
+
+/* XXH64 primes */
+#define XXH_P1 0x9e3779b185ebca87ULL
+#define XXH_P2 0xc2b2ae3d27d4eb4fULL
+#define XXH_P3 0x165667b19e3779f9ULL
+#define XXH_P4 0x85ebca77c2b2ae63ULL
+#define XXH_P5 0x27d4eb2f165667c5ULL
+
+#define HTAB_INIT 64         /* initial hash table size              */
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+
+uint64_t hash_str(uint64_t hash, const char *str)
+{
+    for (const unsigned char *p = (const unsigned char *)str; *p != '\0';
+            p++) {
+        hash ^= *p;
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+uint64_t hash_pair(uint64_t a, uint64_t b)
+{
+    uint64_t hash = (a ^ (b * MIX_PRIME)) * MIX_PRIME;
+
+    return hash ^ (hash >> 32);
+}
+
+void htab_init(htab_t *tab)
+{
+    tab->slots  = NULL;
+    tab->size   = 0;
+    tab->count  = 0;
+}
+
+void htab_free(htab_t *tab)
+{
+    free(tab->slots);
+    htab_init(tab);
+}
+
+void *htab_find(htab_t *tab, uint64_t hash, htab_match_t match,
+                const void *key)
+{
+    if (tab->size == 0)
+        return NULL;
+
+    size_t mask = tab->size - 1;
+    for (size_t slot = hash & mask; tab->slots[slot].item != NULL;
+            slot = (slot + 1) & mask) {
+        hslot_t *s = &tab->slots[slot];
+        if (s->hash == hash && match(s->item, key))
+            return s->item;
+    }
+
+    return NULL;
+}
+
+/* put given item into first free slot, table has one */
+static void htab_put(hslot_t *slots, size_t size, uint64_t hash, void *item)
+{
+    size_t slot = hash & (size - 1);
+    while (slots[slot].item != NULL)
+        slot = (slot + 1) & (size - 1);
+    slots[slot].hash = hash;
+    slots[slot].item = item;
+}
+
+int htab_add(htab_t *tab, uint64_t hash, void *item)
+{
+    if ((tab->count + 1) * 2 > tab->size) {
+        size_t size = (tab->size > 0) ? tab->size * 2 : HTAB_INIT;
+        hslot_t *slots = calloc(size, sizeof(hslot_t));
+        if (slots == NULL)
+            return -1;
+        for (size_t i = 0; i < tab->size; i++)
+            if (tab->slots[i].item != NULL)
+                htab_put(slots, size, tab->slots[i].hash,
+                         tab->slots[i].item);
+        free(tab->slots);
+        tab->slots = slots;
+        tab->size  = size;
+    }
+    htab_put(tab->slots, tab->size, hash, item);
+    tab->count++;
+
+    return 0;
+}
+
+/* little-endian reads, independent of host byte order and alignment */
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t val = 0;
+    for (int i = 7; i >= 0; i--)
+        val = (val << 8) | p[i];
+
+    return val;
+}
+
+static uint64_t read32(const unsigned char *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+           (uint64_t)p[3] << 24;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc = ROTL64(acc, 31);
+
+    return acc * XXH_P1;
+}
+
+static uint64_t xxh64_merge(uint64_t hash, uint64_t acc)
+{
+    hash ^= xxh64_round(0, acc);
+
+    return hash * XXH_P1 + XXH_P4;
+}
+
+/* consume one 32 byte stripe */
+static void xxh64_stripe(uint64_t *acc, const unsigned char *p)
+{
+    for (int i = 0; i < 4; i++)
+        acc[i] = xxh64_round(acc[i], read64(p + i * 8));
+}
+
+void xxh64_init(xxh64_t *state, uint64_t seed)
+{
+    state->acc[0]   = seed + XXH_P1 + XXH_P2;
+    state->acc[1]   = seed + XXH_P2;
+    state->acc[2]   = seed;
+    state->acc[3]   = seed - XXH_P1;
+    state->total    = 0;
+    state->buf_len  = 0;
+    state->seed     = seed;
+}
+
+void xxh64_update(xxh64_t *state, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    state->total += len;
+
+    /* complete buffered stripe first */
+    if (state->buf_len > 0) {
+        size_t fill = 32 - state->buf_len;
+        if (fill > len)
+            fill = len;
+        memcpy(state->buf + state->buf_len, p, fill);
+        state->buf_len += fill;
+        p += fill;
+        len -= fill;
+        if (state->buf_len < 32)
+            return;
+        xxh64_stripe(state->acc, state->buf);
+        state->buf_len = 0;
+    }
+
+    for (; len >= 32; p += 32, len -= 32)
+        xxh64_stripe(state->acc, p);
+
+    memcpy(state->buf, p, len);
+    state->buf_len = len;
+}
+
+uint64_t xxh64_digest(const xxh64_t *state)
+{
+    const uint64_t *acc = state->acc;
+    uint64_t hash;
+
+    if (state->total >= 32) {
+        hash = ROTL64(acc[0], 1) + ROTL64(acc[1], 7) + ROTL64(acc[2], 12) +
+               ROTL64(acc[3], 18);
+        for (int i = 0; i < 4; i++)
+            hash = xxh64_merge(hash, acc[i]);
+    } else {
+        hash = state->seed + XXH_P5;
+    }
+    hash += state->total;
+
+    /* remaining bytes of the last stripe */
+    const unsigned char *p = state->buf;
+    size_t len = state->buf_len;
+    for (; len >= 8; p += 8, len -= 8) {
+        hash ^= xxh64_round(0, read64(p));
+        hash = ROTL64(hash, 27) * XXH_P1 + XXH_P4;
+    }
+    if (len >= 4) {
+        hash ^= read32(p) * XXH_P1;
+        hash = ROTL64(hash, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; p++, len--) {
+        hash ^= *p * XXH_P5;
+        hash = ROTL64(hash, 11) * XXH_P1;
+    }
+
+    /* avalanche */
+    hash ^= hash >> 33;
+    hash *= XXH_P2;
+    hash ^= hash >> 29;
+    hash *= XXH_P3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
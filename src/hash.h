@@ -0,0 +1,87 @@
+/* Copyright lynix <lynix47@gmail.com>, 2009, 2010, 2014
+ *
+ * This file is part of vcp (verbose cp).
+ *
+ * vcp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcp. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <stdint.h>                     // uint64_t
+#include <stddef.h>                     // size_t
+
+#define HASH_SEED 14695981039346656037ULL  /* FNV-1a offset basis     */
+
+
+// continue FNV-1a hash 'hash' over given string, start with HASH_SEED;
+// hashing a path piecewise gives the same result as hashing it at once
+uint64_t hash_str(uint64_t hash, const char *str);
+
+// mix given pair of integers, e.g. device and inode number
+uint64_t hash_pair(uint64_t a, uint64_t b);
+
+
+// slot of a hash table, see htab_t
+typedef struct {
+    uint64_t    hash;
+    void        *item;                  // NULL: free slot
+} hslot_t;
+
+// open addressing hash table of item pointers by 64-bit hash of their key
+// (linear probing, at most half full); not thread-safe
+typedef struct {
+    hslot_t     *slots;
+    size_t      size;
+    size_t      count;
+} htab_t;
+
+// whether given item has given key
+typedef int (*htab_match_t)(const void *item, const void *key);
+
+// initialize given table to empty, memory is taken on first insertion
+void     htab_init(htab_t *tab);
+
+// release memory of given table, not of its items
+void     htab_free(htab_t *tab);
+
+// find item of given key and key hash, NULL if there is none
+void     *htab_find(htab_t *tab, uint64_t hash, htab_match_t match,
+                    const void *key);
+
+// insert given item under given key hash (not checked for being present
+// already), grows table if needed; returns -1 if out of memory
+int      htab_add(htab_t *tab, uint64_t hash, void *item);
+
+
+// incremental XXH64 state, see xxh64_init()
+typedef struct {
+    uint64_t        acc[4];
+    uint64_t        total;              // bytes hashed so far
+    unsigned char   buf[32];            // incomplete stripe
+    size_t          buf_len;
+    uint64_t        seed;
+} xxh64_t;
+
+// start XXH64 content hash with given seed
+void     xxh64_init(xxh64_t *state, uint64_t seed);
+
+// feed given data into hash
+void     xxh64_update(xxh64_t *state, const void *data, size_t len);
+
+// get hash of all data fed so far, state stays usable
+uint64_t xxh64_digest(const xxh64_t *state);
+
+#endif
@@ -24,6 +24,8 @@
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 
 #define BAR_STEP (100.0/(BAR_WIDTH-2))
 
@@ -78,6 +80,56 @@ void print_usage()
     puts("  -u  skip identical existing files");
     puts("  -s  ensure each file is synched to disk after write");
     puts("  -t  ignore errors on preserving uid/gid");
+    puts("Performance:");
+    puts("  -j N, --jobs=N    copy N files concurrently (default: 1)");
+    puts("  --crawl-threads=N read source directories by N threads (for");
+    puts("                    network filesystems), overwrite prompts are");
+    puts("                    asked after crawling (default: 1)");
+    puts("  --stream          start copying while source is still crawled,");
+    puts("                    overwrite prompts are asked at the end");
+    puts("  --streams=N       copy files larger than 256 MiB as ranges by N");
+    puts("                    threads concurrently (default: 1)");
+    puts("  --pipeline        overlap reading and writing using separate");
+    puts("                    threads (for copies between different disks)");
+    puts("  --direct[=SIZE]   bypass page cache (O_DIRECT) for files of at");
+    puts("                    least SIZE, e.g. 512M (default: 1G)");
+    puts("  --buffer=SIZE     use fixed I/O size, e.g. 8M (default: chosen");
+    puts("                    per file from device hints and throughput)");
+    puts("  --nocache         drop copied data from page cache while copying");
+    puts("  --order=ORDER     copy files in 'path' order (default), by source");
+    puts("                    'inode' number or by physical 'extent' position");
+    puts("                    (for rotational disks), directories first");
+    puts("  --sparse[=WHEN]   skip holes of sparse files, WHEN is 'auto'");
+    puts("                    (default if given), 'always' (also turn");
+    puts("                    zero-filled blocks into holes) or 'never'");
+    puts("                    (default)");
+    puts("  --dedup[=HOW]     copy files of identical content only once and");
+    puts("                    recreate the others as 'link' (hardlinks,");
+    puts("                    default if given) or 'reflink' (CoW clones)");
+    puts("  --delta           update existing destination files larger than");
+    puts("                    1 MiB in place, writing only the blocks that");
+    puts("                    differ from the source");
+    puts("  --journal=FILE    record finished items and synced parts of large");
+    puts("                    files in FILE, removed once all is copied");
+    puts("  --resume          skip items finished by the interrupted run of");
+    puts("                    --journal, continue its partial files");
+    puts("  --checksum=FILE   hash data while copying (XXH64), write the");
+    puts("                    checksums of all files copied to FILE in the");
+    puts("                    format of xxh64sum (not with --sparse,");
+    puts("                    --streams or --reflink=always)");
+    puts("  --verify          read back each file copied, bypassing the page");
+    puts("                    cache (or dropping cached pages where O_DIRECT");
+    puts("                    is unsupported), and compare its checksum");
+    puts("                    (same restrictions as --checksum)");
+    puts("  --manifest=FILE   record destination state in FILE; with -u,");
+    puts("                    items in destination directories unchanged");
+    puts("                    since then are compared against it instead of");
+    puts("                    the disk (changes to the files alone are not");
+    puts("                    noticed)");
+    puts("  --reflink[=WHEN]  clone file data on CoW filesystems, WHEN is");
+    puts("                    'auto' (default), 'always' or 'never'");
+    puts("  --uring[=DEPTH]   asynchronous I/O via io_uring, keeping DEPTH");
+    puts("                    requests in flight (default: 8)");
     puts("Output control:");
     puts("  -b  display progress bars and file names (default: text)");
     puts("  -B  display progress bars only, no file names");
@@ -193,6 +245,43 @@ char *size_str(off_t bytes)
     return buffer;
 }
 
+off_t parse_size(char *str)
+{
+    char *end;
+    long long number = strtoll(str, &end, 10);
+    if (end == str || number < 0)
+        return -1;
+
+    int shift = 0;
+    switch (*end) {
+        case 'T':
+        case 't':
+            shift += 10;
+            /* fall through */
+        case 'G':
+        case 'g':
+            shift += 10;
+            /* fall through */
+        case 'M':
+        case 'm':
+            shift += 10;
+            /* fall through */
+        case 'K':
+        case 'k':
+            shift += 10;
+            end++;
+            /* fall through */
+        case '\0':
+            break;
+        default:
+            return -1;
+    }
+    if (*end != '\0' || number > (LLONG_MAX >> shift))
+        return -1;
+
+    return (off_t)number << shift;
+}
+
 char *bar_str(char percent)
 {
     char *result = malloc(BAR_WIDTH + 1);
@@ -221,17 +310,20 @@ char *bar_str(char percent)
 int ask_overwrite(file_t *old, file_t *new)
 {
     char answer;
+    char path[PATH_MAX];
 
     do {
         printf("overwrite ");
         if (old->type != SLINK) {
-            printf("%s (%s)\n", old->src, size_str(old->size));
+            printf("%s (%s)\n", f_src_path(old, path),
+                   size_str(old->size));
         } else {
-            printf("%s (symlink to %s)\n", old->dst, old->ldst);
+            printf("%s (symlink to %s)\n", f_dst_path(old, path), old->ldst);
         }
         printf("     with ");
         if (new->type != SLINK) {
-            printf("%s (%s)\n", new->src, size_str(new->size));
+            printf("%s (%s)\n", f_src_path(new, path),
+                   size_str(new->size));
         } else {
             printf(" symlink to %s\n", new->ldst);
         }
@@ -256,6 +348,7 @@ int ask_overwrite(file_t *old, file_t *new)
 
 void fail_append(strlist_t *fail_list, char *fname, char *error)
 {
+    static pthread_mutex_t fail_lock = PTHREAD_MUTEX_INITIALIZER;
     char *errmsg;
 
     errmsg = strccat(fname, ": ");
@@ -266,10 +359,13 @@ void fail_append(strlist_t *fail_list, char *fname, char *error)
         errmsg = strccat(errmsg, ")");
     }
 
+    /* may be called by concurrent workers */
+    pthread_mutex_lock(&fail_lock);
     if (strlist_add(fail_list, errmsg) != 0) {
         print_debug("failed to add to fail-list:");
         print_error(errmsg);
     }
+    pthread_mutex_unlock(&fail_lock);
 
     return;
 }
@@ -19,7 +19,9 @@
 #ifndef _HELPERS_H
 #define _HELPERS_H
 
+#ifndef _XOPEN_SOURCE
 #define _XOPEN_SOURCE 500
+#endif
 
 #include "file.h"
 #include "lists.h"
@@ -61,6 +63,10 @@ char *path_base(char *path);
 // convert byte number to human readable representation (IEC format)
 char *size_str(off_t bytes);
 
+// parse size given as number with optional K, M, G or T suffix (IEC),
+// returns -1 if malformed
+off_t parse_size(char *str);
+
 // print progress bar for given percentage value
 char *bar_str(char percent);
 
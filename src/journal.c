@@ -0,0 +1,329 @@
+/* Copyright lynix <lynix47@gmail.com>, 2009, 2010, 2014
+ *
+ * This file is part of vcp (verbose cp).
+ *
+ * vcp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcp. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE                     /* getdelim(), syncfs()     */
+
+#include "journal.h"
+#include "arena.h"
+#include "hash.h"
+#include "helpers.h"
+#include "options.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+/* The journal is a sequence of NUL-terminated records, appended only:
+ *   "D <size> <mtime> <path>"           destination item finished
+ *   "P <offset> <size> <mtime> <path>"  destination file synced up to offset
+ * Size and mtime are those of the source, a record of a source changed
+ * since is ignored. A record torn by the interruption ends the journal. */
+
+/* state of a destination path in the interrupted run */
+typedef struct {
+    char        *path;
+    off_t       offset;                 /* committed size, -1: done */
+    long long   size;                   /* source identity          */
+    long long   mtime;
+} jrec_t;
+
+/* records loaded on opening by path, taken from an arena; new records are
+ * collected until the next sync */
+struct journal {
+    htab_t          recs;
+    arena_t         *arena;
+    char            *path;
+    int             fd;
+    int             sync_fd;            /* on destination filesystem */
+    char            *pending;
+    size_t          pending_len;
+    size_t          pending_size;
+    time_t          synced;
+    char            failed;             /* error has been reported  */
+    pthread_mutex_t lock;
+};
+
+
+static int journal_match(const void *item, const void *key)
+{
+    return strcmp(((const jrec_t *)item)->path, (const char *)key) == 0;
+}
+
+/* find record of given path, NULL if there is none */
+static jrec_t *journal_find(journal_t *journal, char *path)
+{
+    return htab_find(&journal->recs, hash_str(HASH_SEED, path),
+                     journal_match, path);
+}
+
+/* size and mtime of given source item as recorded, symlinks carry none */
+static void journal_ident(file_t *src, long long *size, long long *mtime)
+{
+    *size   = (src->type != SLINK) ? src->size : 0;
+    *mtime  = (src->type != SLINK) ? src->times.modtime : 0;
+}
+
+/* enter state of given path, a finished item stays finished */
+static int journal_insert(journal_t *journal, char *path, off_t offset,
+                          long long size, long long mtime)
+{
+    jrec_t *rec = journal_find(journal, path);
+    if (rec == NULL) {
+        rec = arena_alloc(journal->arena, sizeof(jrec_t));
+        if (rec == NULL)
+            return -1;
+        rec->path = arena_strdup(journal->arena, path);
+        if (rec->path == NULL || htab_add(&journal->recs,
+                                          hash_str(HASH_SEED, path),
+                                          rec) != 0)
+            return -1;
+    } else if (rec->offset < 0) {
+        return 0;
+    }
+    rec->offset = offset;
+    rec->size   = size;
+    rec->mtime  = mtime;
+
+    return 0;
+}
+
+/* read records of given journal file, returns the length of its intact
+ * part, or -1 if out of memory */
+static off_t journal_load(journal_t *journal, FILE *file)
+{
+    char *rec = NULL;
+    size_t rec_size = 0;
+    ssize_t len;
+    off_t valid = 0;
+
+    while ((len = getdelim(&rec, &rec_size, '\0', file)) > 0) {
+        if (rec[len - 1] != '\0')
+            break;
+        long long offset = -1, size, mtime;
+        int pos = 0;
+        if (rec[0] == 'D' && sscanf(rec, "D %lld %lld%n", &size, &mtime,
+                                    &pos) != 2)
+            break;
+        if (rec[0] == 'P' && (sscanf(rec, "P %lld %lld %lld%n", &offset,
+                                     &size, &mtime, &pos) != 3 || offset < 0))
+            break;
+        if (pos == 0 || rec[pos] != ' ')
+            break;
+        if (journal_insert(journal, rec + pos + 1, offset, size,
+                           mtime) != 0) {
+            free(rec);
+            return -1;
+        }
+        valid += len;
+    }
+    free(rec);
+
+    return valid;
+}
+
+journal_t *journal_open(char *path, char resume, char readonly)
+{
+    journal_t *journal = malloc(sizeof(journal_t));
+    if (journal == NULL)
+        return NULL;
+    htab_init(&journal->recs);
+    journal->arena          = arena_new();
+    journal->path           = strdup(path);
+    journal->fd             = -1;
+    journal->sync_fd        = -1;
+    journal->pending        = NULL;
+    journal->pending_len    = 0;
+    journal->pending_size   = 0;
+    journal->synced         = time(NULL);
+    journal->failed         = 0;
+    pthread_mutex_init(&journal->lock, NULL);
+    if (journal->arena == NULL || journal->path == NULL) {
+        journal_close(journal, 0);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* continue behind the last intact record */
+    off_t valid = 0;
+    FILE *file = resume ? fopen(path, "r") : NULL;
+    if (file != NULL) {
+        valid = journal_load(journal, file);
+        fclose(file);
+        if (valid < 0) {
+            journal_close(journal, 0);
+            errno = ENOMEM;
+            return NULL;
+        }
+        print_debug("resuming %lu items from journal",
+                    (unsigned long)journal->recs.count);
+    }
+    if (readonly)
+        return journal;
+
+    /* records decide what is skipped, nobody else may write them */
+    journal->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (journal->fd < 0 || ftruncate(journal->fd, valid) != 0) {
+        int err = errno;
+        journal_close(journal, 0);
+        errno = err;
+        return NULL;
+    }
+
+    return journal;
+}
+
+/* make data of the items recorded so far durable, then their records;
+ * called with the lock held */
+static int journal_sync(journal_t *journal)
+{
+    if (journal->pending_len == 0)
+        return 0;
+
+    int ret = 0;
+    if (journal->sync_fd >= 0)
+        ret = syncfs(journal->sync_fd);
+    else
+        sync();
+    char *rec = journal->pending;
+    size_t len = journal->pending_len;
+    while (ret == 0 && len > 0) {
+        ssize_t n = write(journal->fd, rec, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            ret = -1;
+            break;
+        }
+        rec += n;
+        len -= n;
+    }
+    if (ret == 0)
+        ret = fsync(journal->fd);
+    journal->pending_len    = 0;
+    journal->synced         = time(NULL);
+
+    if (ret != 0 && !journal->failed) {
+        print_error("failed to write journal: %s", strerror(errno));
+        journal->failed = 1;
+    }
+
+    return ret;
+}
+
+/* queue given record, called with the lock held */
+static void journal_append(journal_t *journal, char *rec, size_t len)
+{
+    if (journal->pending_len + len > journal->pending_size) {
+        size_t size = (journal->pending_size > 0) ?
+                      journal->pending_size * 2 : PATH_MAX * 16;
+        while (journal->pending_len + len > size)
+            size *= 2;
+        char *pending = realloc(journal->pending, size);
+        /* record is lost, item will be copied again */
+        if (pending == NULL)
+            return;
+        journal->pending        = pending;
+        journal->pending_size   = size;
+    }
+    memcpy(journal->pending + journal->pending_len, rec, len);
+    journal->pending_len += len;
+}
+
+int journal_close(journal_t *journal, char finished)
+{
+    int ret = 0;
+
+    if (journal->fd >= 0) {
+        if (!finished)
+            ret = journal_sync(journal);
+        if (close(journal->fd) != 0)
+            ret = -1;
+    }
+    if (finished && unlink(journal->path) != 0)
+        ret = -1;
+    if (journal->sync_fd >= 0)
+        close(journal->sync_fd);
+
+    pthread_mutex_destroy(&journal->lock);
+    free(journal->pending);
+    free(journal->path);
+    htab_free(&journal->recs);
+    if (journal->arena != NULL)
+        arena_delete(journal->arena);
+    free(journal);
+
+    return ret;
+}
+
+int journal_state(journal_t *journal, char *dst, file_t *src, off_t *offset)
+{
+    long long size, mtime;
+    journal_ident(src, &size, &mtime);
+
+    /* table is not modified after loading, no locking needed */
+    jrec_t *rec = journal_find(journal, dst);
+    if (rec == NULL)
+        return JOURNAL_NONE;
+    if (rec->size != size || rec->mtime != mtime) {
+        print_debug("source of '%s' changed, not resuming it", dst);
+        return JOURNAL_NONE;
+    }
+    if (rec->offset < 0)
+        return JOURNAL_DONE;
+    *offset = rec->offset;
+
+    return JOURNAL_PARTIAL;
+}
+
+void journal_done(journal_t *journal, char *dst, file_t *src)
+{
+    char rec[PATH_MAX + 64];
+    long long size, mtime;
+    journal_ident(src, &size, &mtime);
+    int len = snprintf(rec, sizeof(rec), "D %lld %lld %s", size, mtime, dst);
+
+    pthread_mutex_lock(&journal->lock);
+    /* symlinks are not followed to other filesystems */
+    if (journal->sync_fd < 0)
+        journal->sync_fd = open(dst, O_RDONLY | O_NOFOLLOW);
+    journal_append(journal, rec, len + 1);
+    if (time(NULL) - journal->synced >= JOURNAL_SYNC)
+        journal_sync(journal);
+    pthread_mutex_unlock(&journal->lock);
+}
+
+void journal_partial(journal_t *journal, char *dst, file_t *src,
+                     off_t offset)
+{
+    char rec[PATH_MAX + 96];
+    long long size, mtime;
+    journal_ident(src, &size, &mtime);
+    int len = snprintf(rec, sizeof(rec), "P %lld %lld %lld %s",
+                       (long long)offset, size, mtime, dst);
+
+    pthread_mutex_lock(&journal->lock);
+    journal_append(journal, rec, len + 1);
+    journal_sync(journal);
+    pthread_mutex_unlock(&journal->lock);
+}
@@ -0,0 +1,62 @@
+/* Copyright lynix <lynix47@gmail.com>, 2009, 2010, 2014
+ *
+ * This file is part of vcp (verbose cp).
+ *
+ * vcp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcp. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <sys/types.h>                  // off_t
+
+#include "file.h"
+
+// record of finished destination items and committed parts of large files
+// (--journal), so that an interrupted run can be resumed (--resume)
+typedef struct journal journal_t;
+
+// states of a destination item, see journal_state()
+#define JOURNAL_NONE    0
+#define JOURNAL_DONE    1
+#define JOURNAL_PARTIAL 2
+
+
+// open given journal file: records of an interrupted run are loaded if
+// 'resume' is set, the file is started anew otherwise; with 'readonly',
+// records are only loaded and the file is left alone; returns NULL on
+// error (see errno)
+journal_t *journal_open(char *path, char resume, char readonly);
+
+// write pending records (see journal_done()) and close given journal,
+// remove its file if the job has been finished
+int     journal_close(journal_t *journal, char finished);
+
+// look up given destination path in the records loaded on opening, a
+// record taken of another size or mtime of given source item does not
+// count; '*offset' is set to the committed size of a partial file
+int     journal_state(journal_t *journal, char *dst, file_t *src,
+                      off_t *offset);
+
+// record given destination item as finished, along with size and mtime of
+// its source item; records are written in batches after syncing the
+// destination filesystem, at least every JOURNAL_SYNC seconds
+void    journal_done(journal_t *journal, char *dst, file_t *src);
+
+// record that the data of given destination file up to 'offset' has been
+// synced to disk, written right away (see journal_done())
+void    journal_partial(journal_t *journal, char *dst, file_t *src,
+                        off_t offset);
+
+#endif
@@ -18,13 +18,19 @@
 
 #include "lists.h"
 #include "helpers.h"
+#include "manifest.h"
+#include "journal.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 
 #define INIT_SIZE 5L
 
+#define WALK_LISTED 1   /* item is part of the list being sorted    */
+#define WALK_LINKED 2   /* item has been linked into the tree       */
+
 
 flist_t *flist_new()
 {
@@ -33,7 +39,11 @@ flist_t *flist_new()
         return NULL;
 
     list->items = calloc(INIT_SIZE, sizeof(file_t *));
-    if (list->items == NULL) {
+    list->arena = arena_new();
+    if (list->items == NULL || list->arena == NULL) {
+        free(list->items);
+        if (list->arena != NULL)
+            arena_delete(list->arena);
         free(list);
         return NULL;
     }
@@ -43,6 +53,10 @@ flist_t *flist_new()
     list->size          = 0;
     list->bytes_done    = 0;
     list->arr_size      = INIT_SIZE;
+    list->hardlinks     = 0;
+    list->manifest      = NULL;
+    list->journal       = NULL;
+    htab_init(&list->inodes);
 
     return list;
 }
@@ -52,10 +66,76 @@ void flist_delete(flist_t *list)
     for (ulong i = 0; i < list->count; i++)
         f_delete(list->items[i]);
 
+    arena_delete(list->arena);
+    if (list->manifest != NULL)
+        manifest_delete(list->manifest);
+    if (list->journal != NULL)
+        journal_close(list->journal, 0);
+    htab_free(&list->inodes);
     free(list->items);
     free(list);
 }
 
+/* source inode looked up in the index */
+typedef struct {
+    dev_t   dev;
+    ino_t   ino;
+} ino_key_t;
+
+static int flist_match_ino(const void *item, const void *key)
+{
+    const file_t *file = (const file_t *)item;
+    const ino_key_t *ino_key = (const ino_key_t *)key;
+
+    return file->dev == ino_key->dev && file->ino == ino_key->ino;
+}
+
+/* enter given item into inode index, unless an item of its inode is there
+ * already; symlinks carry no inode */
+static int flist_index_put(flist_t *list, file_t *file)
+{
+    if (file->type == SLINK)
+        return 0;
+
+    ino_key_t key = { file->dev, file->ino };
+    uint64_t hash = hash_pair(file->dev, file->ino);
+    if (htab_find(&list->inodes, hash, flist_match_ino, &key) != NULL)
+        return 0;
+
+    return htab_add(&list->inodes, hash, file);
+}
+
+/* build inode index of given list, the first item of an inode in list order
+ * is kept */
+static int flist_index(flist_t *list)
+{
+    for (ulong i = 0; i < list->count; i++) {
+        if (flist_index_put(list, list->items[i]) != 0) {
+            htab_free(&list->inodes);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* link given regular file with several links to the first item of the same
+ * inode in list order, unless it is that one; returns the bytes saved */
+static off_t flist_link(flist_t *list, file_t *file)
+{
+    if (file->type != RFILE || file->nlink < 2 || file->link != NULL)
+        return 0;
+
+    file_t *first = flist_search_ino(list, file->dev, file->ino);
+    if (first == NULL || first == file)
+        return 0;
+    off_t saved = file->xfer;
+    file->link = first;
+    file->xfer = 0;
+
+    return saved;
+}
+
 int flist_add(flist_t *list, file_t *file)
 {
     if (list == NULL)
@@ -70,11 +150,14 @@ int flist_add(flist_t *list, file_t *file)
         list->arr_size *= 2L;
     }
 
+    if (list->hardlinks)
+        flist_link(list, file);
+
     /* insert new item, update counters */
     list->items[list->count] = file;
     ulong temp_c = list->count;
     off_t temp_s = list->size;
-    list->size += file->size;
+    list->size += file->xfer;
     list->count++;
     if (list->count <= temp_c || list->size < temp_s) {
         /* overflow */
@@ -87,24 +170,178 @@ int flist_add(flist_t *list, file_t *file)
     if (file->type == RFILE)
         list->count_f++;
 
+    /* keep index up to date once there is one, drop it if it cannot grow
+     * (rebuilt on next search) */
+    if (list->inodes.slots != NULL && flist_index_put(list, file) != 0)
+        htab_free(&list->inodes);
+
     return 0;
 }
 
-file_t *flist_search_src(flist_t *list, char *src)
+file_t *flist_search_ino(flist_t *list, dev_t dev, ino_t ino)
 {
+    ino_key_t key = { dev, ino };
+
+    /* out of memory: fall back to scanning the list */
+    if (list->inodes.slots == NULL && flist_index(list) != 0) {
+        for (ulong i = 0; i < list->count; i++) {
+            if (list->items[i]->type != SLINK &&
+                    flist_match_ino(list->items[i], &key))
+                return list->items[i];
+        }
+        return NULL;
+    }
+
+    return htab_find(&list->inodes, hash_pair(dev, ino), flist_match_ino,
+                     &key);
+}
+
+/* merge sort given chain of siblings linked by 'next': by name, or by
+ * destination path for top-level items */
+static file_t *flist_sort_chain(file_t *head)
+{
+    if (head == NULL || head->next == NULL)
+        return head;
+
+    /* split in halves */
+    file_t *half = head, *end = head->next;
+    while (end != NULL && end->next != NULL) {
+        half = half->next;
+        end = end->next->next;
+    }
+    file_t *b = flist_sort_chain(half->next);
+    half->next = NULL;
+    file_t *a = flist_sort_chain(head);
+
+    /* merge */
+    file_t *result = NULL, **tail = &result;
+    while (a != NULL && b != NULL) {
+        int cmp = (a->parent == NULL) ? strcmp(a->dst, b->dst) :
+                                        strcmp(a->fname, b->fname);
+        if (cmp <= 0) {
+            *tail = a;
+            a = a->next;
+        } else {
+            *tail = b;
+            b = b->next;
+        }
+        tail = &(*tail)->next;
+    }
+    *tail = (a != NULL) ? a : b;
+
+    return result;
+}
+
+void flist_sort(flist_t *list)
+{
+    /* link items and the directories above them into a tree */
+    file_t *roots = NULL;
+    for (ulong i = 0; i < list->count; i++)
+        list->items[i]->walk = WALK_LISTED;
     for (ulong i = 0; i < list->count; i++) {
-        if (strcmp(list->items[i]->src, src) == 0 &&
-                list->items[i]->type != SLINK) {
-            return list->items[i];
+        file_t *f = list->items[i];
+        while (!(f->walk & WALK_LINKED)) {
+            f->walk |= WALK_LINKED;
+            file_t **head = (f->parent != NULL) ? &f->parent->child : &roots;
+            f->next = *head;
+            *head = f;
+            if (f->parent == NULL)
+                break;
+            f = f->parent;
+        }
+    }
+
+    /* first items of an inode change, index is rebuilt on next search */
+    htab_free(&list->inodes);
+
+    /* depth-first walk, directories before their contents; the walk state
+     * is reset on the way */
+    ulong k = 0;
+    file_t *f = flist_sort_chain(roots);
+    while (f != NULL) {
+        if (f->walk & WALK_LISTED)
+            list->items[k++] = f;
+        f->walk = 0;
+        if (f->child != NULL) {
+            file_t *child = flist_sort_chain(f->child);
+            f->child = NULL;
+            f = child;
+            continue;
         }
+        /* leave finished subtrees */
+        while (f != NULL) {
+            file_t *next = f->next;
+            f->next = NULL;
+            if (next != NULL) {
+                f = next;
+                break;
+            }
+            f = f->parent;
+        }
+    }
+}
+
+/* scheduling key of an item, see flist_order() */
+typedef struct {
+    char        dir;
+    uint64_t    key;
+    ino_t       ino;
+    ulong       pos;
+    file_t      *item;
+} order_key_t;
+
+static int flist_cmpr_key(const void *a, const void *b)
+{
+    const order_key_t *key_a = (const order_key_t *)a;
+    const order_key_t *key_b = (const order_key_t *)b;
+
+    /* directories keep their tree order, parents come first */
+    if (key_a->dir != key_b->dir)
+        return key_b->dir - key_a->dir;
+    if (key_a->dir)
+        return (key_a->pos < key_b->pos) ? -1 : (key_a->pos > key_b->pos);
+    if (key_a->key != key_b->key)
+        return (key_a->key < key_b->key) ? -1 : 1;
+    if (key_a->ino != key_b->ino)
+        return (key_a->ino < key_b->ino) ? -1 : 1;
+
+    return (key_a->pos < key_b->pos) ? -1 : (key_a->pos > key_b->pos);
+}
+
+int flist_order(flist_t *list, order_t order)
+{
+    if (list->count == 0 || order == ORDER_PATH)
+        return 0;
+
+    order_key_t *keys = malloc(list->count * sizeof(order_key_t));
+    if (keys == NULL)
+        return -1;
+
+    /* files without known extent (e.g. empty ones) go last, by inode */
+    for (ulong i = 0; i < list->count; i++) {
+        file_t *item = list->items[i];
+        keys[i].dir     = item->type == RDIR;
+        keys[i].key     = 0;
+        keys[i].ino     = item->ino;
+        keys[i].pos     = i;
+        keys[i].item    = item;
+        if (order == ORDER_EXTENT && item->type == RFILE && !item->done &&
+                f_extent(item, &keys[i].key) != 0)
+            keys[i].key = UINT64_MAX;
     }
+    qsort(keys, list->count, sizeof(order_key_t), flist_cmpr_key);
+    for (ulong i = 0; i < list->count; i++)
+        list->items[i] = keys[i].item;
+    free(keys);
+    htab_free(&list->inodes);
 
-    return NULL;
+    return 0;
 }
 
-inline void flist_sort(flist_t *list)
+void flist_link_all(flist_t *list)
 {
-    qsort(list->items, list->arr_size, sizeof(file_t *), f_cmpr_dst);
+    for (ulong i = 0; i < list->count; i++)
+        list->size -= flist_link(list, list->items[i]);
 }
 
 int flist_shrink(flist_t *list)
@@ -122,6 +359,7 @@ void flist_print(flist_t *list, opts_t *opts)
 {
     off_t size = 0;
     ulong count = 0;
+    off_t saved_links = 0, saved_dups = 0;
     char mark = 0;
 
     for (ulong i = 0; i < list->count; i++) {
@@ -133,18 +371,25 @@ void flist_print(flist_t *list, opts_t *opts)
         if (item->type == RFILE) {
             printf(" [F] ");
             count++;
-            size += item->size;
+            size += item->xfer;
         } else if (item->type == RDIR) {
             printf(" [D] ");
         } else if (item->type == SLINK) {
             printf(" [S] ");
         }
 
-        printf("%s --> %s", item->src, item->dst);
+        char src[PATH_MAX], dst[PATH_MAX];
+        printf("%s --> %s", f_src_path(item, src), f_dst_path(item, dst));
 
         if (item->done) {
             mark = 1;
             printf("(*)");
+        } else if (item->link != NULL && F_SAME_INODE(item, item->link)) {
+            printf(" (hardlink)");
+            saved_links += item->size;
+        } else if (item->link != NULL) {
+            printf(" (duplicate)");
+            saved_dups += item->size;
         } else if (item->type == RFILE) {
             printf(" (%s)", size_str(item->size));
         }
@@ -157,7 +402,12 @@ void flist_print(flist_t *list, opts_t *opts)
         puts("(*) marked items already exist at their destination");
         puts("    and do not count for transfer size.\n");
     }
-    printf("Total transfer size: %lu file(s), %s\n\n", count, size_str(size));
+    printf("Total transfer size: %lu file(s), %s\n", count, size_str(size));
+    if (saved_links > 0)
+        printf("Saved by hardlinks: %s\n", size_str(saved_links));
+    if (saved_dups > 0)
+        printf("Saved by deduplication: %s\n", size_str(saved_dups));
+    putchar('\n');
     fflush(stdout);
 
     return;
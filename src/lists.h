@@ -20,6 +20,7 @@
 #define _LISTS_H
 
 #include "file.h"
+#include "hash.h"
 #include "options.h"
 
 #include <sys/types.h>
@@ -33,26 +34,48 @@ typedef struct {
     off_t   size;
     off_t   bytes_done;
     file_t  **items;
+    arena_t *arena;                     // memory of items, see f_new_at()
+    htab_t  inodes;                     // items by source device and inode,
+                                        // built on first search
+    char    hardlinks;                  // detect hardlinks in flist_add(),
+                                        // see flist_link_all()
+    struct manifest *manifest;          // destination state, see crawl()
+    struct journal *journal;            // finished items, see crawl()
 } flist_t;
 
 // create new file list
 flist_t *flist_new();
 
-// delete given file list
+// delete given file list, including its items, their arena, manifest and
+// journal (which is kept on disk)
 void    flist_delete(flist_t *list);
 
-// find file item by given source path in given file list
-file_t  *flist_search_src(flist_t *list, char *item);
+// find first file item of given source device and inode in given file list,
+// by a hash index that is kept up to date by flist_add() from then on
+file_t  *flist_search_ino(flist_t *list, dev_t dev, ino_t ino);
 
-// add given file item to given file list
+// add given file item to given file list; with hardlink detection enabled,
+// a regular file whose inode has been added before is linked to that item
+// (see file_t) and does not count for transfer size
 int     flist_add(flist_t *list, file_t *item);
 
+// link regular files of given list to the first item of the same source
+// inode in list order, like flist_add() does with hardlink detection; the
+// result does not depend on crawl order once the list is sorted
+void    flist_link_all(flist_t *list);
+
 // shrink given file list structure allocation to required size
 int     flist_shrink(flist_t *list);
 
-// sort given file list (by destination path)
+// sort given file list in tree order (by destination path), directories
+// before their contents
 void    flist_sort(flist_t *list);
 
+// reorder given file list for copying: directories first (in tree order),
+// then the other items by source inode number or first physical extent;
+// flist_sort() restores tree order
+int     flist_order(flist_t *list, order_t order);
+
 // print textual representation of given list to stdout
 void    flist_print(flist_t *list, opts_t *opts);
 
@@ -0,0 +1,316 @@
+/* Copyright lynix <lynix47@gmail.com>, 2009, 2010, 2014
+ *
+ * This file is part of vcp (verbose cp).
+ *
+ * vcp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcp. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE                     /* st_mtim                  */
+
+#include "manifest.h"
+#include "hash.h"
+#include "helpers.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define MANIFEST_MAGIC "vcpman2\n"   /* file header, 8 bytes     */
+#define MANIFEST_INIT 1024L             /* initial directory list   */
+
+/* recorded state of a destination item, written to the file as it is,
+ * followed by the NUL-terminated path */
+typedef struct {
+    int64_t     size;
+    int64_t     mtime;
+    int64_t     ino;
+    uint32_t    uid;
+    uint32_t    gid;
+    int32_t     mtime_ns;               /* directories only         */
+    char        type;
+    char        seen;                   /* confirmed in this run    */
+} mstate_t;
+
+typedef struct {
+    mstate_t    state;
+    char        *path;
+} mrec_t;
+
+/* records by path, taken from an arena */
+struct manifest {
+    htab_t          recs;
+    arena_t         *arena;
+    file_t          **dirs;             /* directories to record    */
+    ulong           dirs_count;
+    ulong           dirs_size;
+    pthread_mutex_t lock;
+};
+
+
+static int manifest_match(const void *item, const void *key)
+{
+    return strcmp(((const mrec_t *)item)->path, (const char *)key) == 0;
+}
+
+/* find record of given path, NULL if there is none */
+static mrec_t *manifest_find(manifest_t *manifest, char *path)
+{
+    return htab_find(&manifest->recs, hash_str(HASH_SEED, path),
+                     manifest_match, path);
+}
+
+/* insert or overwrite record of given path */
+static int manifest_insert(manifest_t *manifest, char *path, mstate_t *state)
+{
+    mrec_t *rec = manifest_find(manifest, path);
+    if (rec == NULL) {
+        rec = arena_alloc(manifest->arena, sizeof(mrec_t));
+        if (rec == NULL)
+            return -1;
+        rec->path = arena_strdup(manifest->arena, path);
+        if (rec->path == NULL || htab_add(&manifest->recs,
+                                          hash_str(HASH_SEED, path),
+                                          rec) != 0)
+            return -1;
+    }
+    rec->state = *state;
+
+    return 0;
+}
+
+manifest_t *manifest_load(char *path)
+{
+    manifest_t *manifest = malloc(sizeof(manifest_t));
+    if (manifest == NULL)
+        return NULL;
+    manifest->arena         = arena_new();
+    manifest->dirs          = NULL;
+    manifest->dirs_count    = 0;
+    manifest->dirs_size     = 0;
+    if (manifest->arena == NULL) {
+        free(manifest);
+        return NULL;
+    }
+    htab_init(&manifest->recs);
+    pthread_mutex_init(&manifest->lock, NULL);
+
+    /* first run: everything is stat()'ed */
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        print_debug("no manifest '%s' yet", path);
+        return manifest;
+    }
+    char magic[sizeof(MANIFEST_MAGIC) - 1];
+    if (fread(magic, sizeof(magic), 1, file) != 1 ||
+            memcmp(magic, MANIFEST_MAGIC, sizeof(magic)) != 0) {
+        print_error("ignoring invalid manifest '%s'", path);
+        fclose(file);
+        return manifest;
+    }
+    /* a record torn by an interruption ends the manifest */
+    mstate_t state;
+    char *rec_path = NULL;
+    size_t rec_size = 0;
+    ssize_t len;
+    while (fread(&state, sizeof(state), 1, file) == 1 &&
+            (len = getdelim(&rec_path, &rec_size, '\0', file)) > 0 &&
+            rec_path[len - 1] == '\0') {
+        state.seen = 0;
+        if (manifest_insert(manifest, rec_path, &state) != 0) {
+            free(rec_path);
+            fclose(file);
+            manifest_delete(manifest);
+            return NULL;
+        }
+    }
+    free(rec_path);
+    fclose(file);
+    print_debug("loaded %lu manifest records",
+                (unsigned long)manifest->recs.count);
+
+    return manifest;
+}
+
+void manifest_delete(manifest_t *manifest)
+{
+    pthread_mutex_destroy(&manifest->lock);
+    htab_free(&manifest->recs);
+    arena_delete(manifest->arena);
+    free(manifest->dirs);
+    free(manifest);
+}
+
+int manifest_trust(manifest_t *manifest, file_t *dir, int dst_fd, char *dst)
+{
+    struct stat st;
+    if (fstat(dst_fd, &st) != 0)
+        return 0;
+
+    pthread_mutex_lock(&manifest->lock);
+    int trust = 0;
+    mrec_t *rec = manifest_find(manifest, dst);
+    if (rec != NULL && rec->state.type == RDIR &&
+            rec->state.ino == (int64_t)st.st_ino &&
+            rec->state.mtime == (int64_t)st.st_mtim.tv_sec &&
+            rec->state.mtime_ns == (int32_t)st.st_mtim.tv_nsec)
+        trust = 1;
+
+    /* directory is recorded again at the end, whatever happens to it */
+    if (manifest->dirs_count == manifest->dirs_size) {
+        ulong size = (manifest->dirs_size > 0) ? manifest->dirs_size * 2 :
+                                                 MANIFEST_INIT;
+        file_t **dirs = realloc(manifest->dirs, size * sizeof(file_t *));
+        if (dirs == NULL) {
+            pthread_mutex_unlock(&manifest->lock);
+            return 0;
+        }
+        manifest->dirs      = dirs;
+        manifest->dirs_size = size;
+    }
+    manifest->dirs[manifest->dirs_count++] = dir;
+    pthread_mutex_unlock(&manifest->lock);
+
+    return trust;
+}
+
+int manifest_equal(manifest_t *manifest, char *dst, file_t *item)
+{
+    pthread_mutex_lock(&manifest->lock);
+    mrec_t *rec = manifest_find(manifest, dst);
+    int equal = 0;
+    if (rec != NULL) {
+        /* just the fields compared by f_equal() */
+        file_t old;
+        old.type            = rec->state.type;
+        old.size            = rec->state.size;
+        old.uid             = rec->state.uid;
+        old.gid             = rec->state.gid;
+        old.times.modtime   = rec->state.mtime;
+        equal = f_equal(item, &old);
+        if (equal)
+            rec->state.seen = 1;
+    }
+    pthread_mutex_unlock(&manifest->lock);
+
+    return equal;
+}
+
+int manifest_put(manifest_t *manifest, char *dst, file_t *state)
+{
+    /* symlinks are always checked, their target is not recorded; the
+     * directories are recorded with their final state by manifest_save() */
+    if (state->type != RFILE)
+        return 0;
+
+    mstate_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type    = state->type;
+    rec.size    = state->size;
+    rec.mtime   = state->times.modtime;
+    rec.ino     = state->ino;
+    rec.uid     = state->uid;
+    rec.gid     = state->gid;
+    rec.seen    = 1;
+
+    pthread_mutex_lock(&manifest->lock);
+    int ret = manifest_insert(manifest, dst, &rec);
+    pthread_mutex_unlock(&manifest->lock);
+
+    return ret;
+}
+
+/* record given destination path as it is now, nothing if it is gone */
+static int manifest_stat(manifest_t *manifest, char *dst)
+{
+    struct stat st;
+    if (lstat(dst, &st) != 0 || !(S_ISREG(st.st_mode) ||
+                                  S_ISDIR(st.st_mode)))
+        return 0;
+
+    mstate_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type        = S_ISDIR(st.st_mode) ? RDIR : RFILE;
+    rec.size        = S_ISREG(st.st_mode) ? st.st_size : 0;
+    rec.mtime       = st.st_mtim.tv_sec;
+    rec.mtime_ns    = st.st_mtim.tv_nsec;
+    rec.ino         = st.st_ino;
+    rec.uid         = st.st_uid;
+    rec.gid         = st.st_gid;
+    rec.seen        = 1;
+
+    return manifest_insert(manifest, dst, &rec);
+}
+
+int manifest_save(manifest_t *manifest, flist_t *list, char *path)
+{
+    char dst[PATH_MAX];
+
+    /* copied items changed, directories may have changed by copying */
+    for (ulong i = 0; i < list->count; i++)
+        if (list->items[i]->done == 1 &&
+                manifest_stat(manifest, f_dst_path(list->items[i], dst)) != 0)
+            return -1;
+    for (ulong i = 0; i < manifest->dirs_count; i++)
+        if (manifest_stat(manifest, f_dst_path(manifest->dirs[i], dst)) != 0)
+            return -1;
+
+    char *tmp = strccat(path, ".tmp");
+    if (tmp == NULL)
+        return -1;
+    /* records decide what is skipped, nobody else may write them */
+    unlink(tmp);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    FILE *file = (fd >= 0) ? fdopen(fd, "w") : NULL;
+    if (file == NULL) {
+        int err = errno;
+        if (fd >= 0)
+            close(fd);
+        free(tmp);
+        errno = err;
+        return -1;
+    }
+
+    /* records not confirmed belong to items gone or failed */
+    ulong written = 0;
+    int ret = (fwrite(MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC) - 1, 1,
+                      file) == 1) ? 0 : -1;
+    for (size_t i = 0; ret == 0 && i < manifest->recs.size; i++) {
+        mrec_t *rec = manifest->recs.slots[i].item;
+        if (rec == NULL || !rec->state.seen)
+            continue;
+        if (fwrite(&rec->state, sizeof(mstate_t), 1, file) != 1 ||
+                fwrite(rec->path, strlen(rec->path) + 1, 1, file) != 1)
+            ret = -1;
+        written++;
+    }
+    if (fclose(file) != 0)
+        ret = -1;
+    if (ret == 0)
+        ret = rename(tmp, path);
+    if (ret != 0) {
+        int err = errno;
+        unlink(tmp);
+        errno = err;
+    }
+    free(tmp);
+    print_debug("saved %lu manifest records", written);
+
+    return ret;
+}
@@ -0,0 +1,57 @@
+/* Copyright lynix <lynix47@gmail.com>, 2009, 2010, 2014
+ *
+ * This file is part of vcp (verbose cp).
+ *
+ * vcp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcp. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MANIFEST_H
+#define _MANIFEST_H
+
+#include "file.h"
+#include "lists.h"
+
+// state of the destination tree as left by the last run (--manifest):
+// destination items below a directory that has not been modified since
+// then are compared against their records instead of being stat()'ed
+typedef struct manifest manifest_t;
+
+
+// load manifest from given file, a missing or unreadable one gives an
+// empty manifest; returns NULL if out of memory
+manifest_t *manifest_load(char *path);
+
+// delete given manifest
+void    manifest_delete(manifest_t *manifest);
+
+// check whether given directory item's destination, open as 'dst_fd', is
+// unchanged since its record was taken; remembers the item for
+// manifest_save()
+int     manifest_trust(manifest_t *manifest, file_t *dir, int dst_fd,
+                       char *dst);
+
+// check whether a destination item of given path has been recorded and
+// equals given source item (see f_equal()), keeps the record if so
+int     manifest_equal(manifest_t *manifest, char *dst, file_t *item);
+
+// record state of given destination path, as found in given item (regular
+// files only)
+int     manifest_put(manifest_t *manifest, char *dst, file_t *state);
+
+// record destinations of the finished items of given list and of the
+// directories checked while crawling, write all records taken in this run
+// to given file (atomically, by renaming)
+int     manifest_save(manifest_t *manifest, flist_t *list, char *path);
+
+#endif
@@ -20,9 +20,67 @@
 #include "helpers.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include <ctype.h>
 
+#define SHORT_OPTS "bdfhj:kpqstuvDBQ"
+
+/* identifiers for options without short form */
+enum {
+    OPT_REFLINK = 256,
+    OPT_URING,
+    OPT_STREAMS,
+    OPT_PIPELINE,
+    OPT_DIRECT,
+    OPT_NOCACHE,
+    OPT_SPARSE,
+    OPT_BUFFER,
+    OPT_CRAWL_THREADS,
+    OPT_STREAM,
+    OPT_ORDER,
+    OPT_DEDUP,
+    OPT_MANIFEST,
+    OPT_DELTA,
+    OPT_JOURNAL,
+    OPT_RESUME,
+    OPT_CHECKSUM,
+    OPT_VERIFY
+};
+
+static struct option long_opts[] = {
+    { "reflink",    optional_argument,  NULL,   OPT_REFLINK },
+    { "uring",      optional_argument,  NULL,   OPT_URING   },
+    { "jobs",       required_argument,  NULL,   'j'         },
+    { "streams",    required_argument,  NULL,   OPT_STREAMS },
+    { "pipeline",   no_argument,        NULL,   OPT_PIPELINE},
+    { "direct",     optional_argument,  NULL,   OPT_DIRECT  },
+    { "nocache",    no_argument,        NULL,   OPT_NOCACHE },
+    { "sparse",     optional_argument,  NULL,   OPT_SPARSE  },
+    { "buffer",     required_argument,  NULL,   OPT_BUFFER  },
+    { "crawl-threads", required_argument, NULL, OPT_CRAWL_THREADS },
+    { "stream",     no_argument,        NULL,   OPT_STREAM  },
+    { "order",      required_argument,  NULL,   OPT_ORDER   },
+    { "dedup",      optional_argument,  NULL,   OPT_DEDUP   },
+    { "manifest",   required_argument,  NULL,   OPT_MANIFEST},
+    { "delta",      no_argument,        NULL,   OPT_DELTA   },
+    { "journal",    required_argument,  NULL,   OPT_JOURNAL },
+    { "resume",     no_argument,        NULL,   OPT_RESUME  },
+    { "checksum",   required_argument,  NULL,   OPT_CHECKSUM},
+    { "verify",     no_argument,        NULL,   OPT_VERIFY  },
+    { NULL,         0,                  NULL,   0           }
+};
+
+/* find long option of given identifier, NULL if there is none */
+static const struct option *find_long_opt(int val)
+{
+    for (const struct option *opt = long_opts; opt->name != NULL; opt++)
+        if (opt->val == val)
+            return opt;
+
+    return NULL;
+}
+
 void init_opts(opts_t *opts)
 {
     opts->bars              = 0;
@@ -37,18 +95,38 @@ void init_opts(opts_t *opts)
     opts->pretend           = 0;
     opts->debug             = 0;
     opts->ignore_uid_err    = 0;
+    opts->pipeline          = 0;
+    opts->nocache           = 0;
+    opts->stream            = 0;
+    opts->delta             = 0;
+    opts->resume            = 0;
+    opts->verify            = 0;
+    opts->clone             = CLONE_AUTO;
+    opts->sparse            = SPARSE_NEVER;
+    opts->order             = ORDER_PATH;
+    opts->dedup             = DEDUP_NONE;
+    opts->queue_depth       = 0;
+    opts->jobs              = 1;
+    opts->streams           = 1;
+    opts->direct_min        = 0;
+    opts->buffer            = 0;
+    opts->crawl_threads     = 1;
+    opts->manifest          = NULL;
+    opts->journal           = NULL;
+    opts->checksum          = NULL;
 
     return;
 }
 
 int parse_opts(opts_t *opts, int argc, char *argv[])
 {
-    char c;
+    int c;
     extern int optind, optopt, opterr;
 
     opterr = 0;
 
-    while ((c = getopt(argc, argv, "bdfhkpqstuvDBQ")) != -1) {
+    while ((c = getopt_long(argc, argv, SHORT_OPTS, long_opts,
+                            NULL)) != -1) {
         switch (c) {
             case 'b':
                 opts->bars = 1;
@@ -65,6 +143,117 @@ int parse_opts(opts_t *opts, int argc, char *argv[])
                     return -1;
                 }
                 break;
+            case 'j': {
+                char *end;
+                long jobs = strtol(optarg, &end, 10);
+                if (*end != '\0' || jobs < 1 || jobs > 1024) {
+                    print_error("invalid number of jobs \"%s\".", optarg);
+                    return -1;
+                }
+                opts->jobs = jobs;
+                break;
+            }
+            case OPT_STREAMS: {
+                char *end;
+                long streams = strtol(optarg, &end, 10);
+                if (*end != '\0' || streams < 1 || streams > 256) {
+                    print_error("invalid number of streams \"%s\".", optarg);
+                    return -1;
+                }
+                opts->streams = streams;
+                break;
+            }
+            case OPT_CRAWL_THREADS: {
+                char *end;
+                long threads = strtol(optarg, &end, 10);
+                if (*end != '\0' || threads < 1 || threads > 256) {
+                    print_error("invalid number of crawler threads \"%s\".",
+                                optarg);
+                    return -1;
+                }
+                opts->crawl_threads = threads;
+                break;
+            }
+            case OPT_STREAM:
+                opts->stream = 1;
+                break;
+            case OPT_PIPELINE:
+                opts->pipeline = 1;
+                break;
+            case OPT_SPARSE:
+                if (optarg == NULL || strcmp(optarg, "auto") == 0) {
+                    opts->sparse = SPARSE_AUTO;
+                } else if (strcmp(optarg, "always") == 0) {
+                    opts->sparse = SPARSE_ALWAYS;
+                } else if (strcmp(optarg, "never") == 0) {
+                    opts->sparse = SPARSE_NEVER;
+                } else {
+                    print_error("invalid sparse mode \"%s\".", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_ORDER:
+                if (strcmp(optarg, "path") == 0) {
+                    opts->order = ORDER_PATH;
+                } else if (strcmp(optarg, "inode") == 0) {
+                    opts->order = ORDER_INODE;
+                } else if (strcmp(optarg, "extent") == 0) {
+                    opts->order = ORDER_EXTENT;
+                } else {
+                    print_error("invalid copy order \"%s\".", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_DEDUP:
+                if (optarg == NULL || strcmp(optarg, "link") == 0) {
+                    opts->dedup = DEDUP_LINK;
+                } else if (strcmp(optarg, "reflink") == 0) {
+                    opts->dedup = DEDUP_REFLINK;
+                } else {
+                    print_error("invalid dedup mode \"%s\".", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_DELTA:
+                opts->delta = 1;
+                break;
+            case OPT_CHECKSUM:
+                opts->checksum = optarg;
+                break;
+            case OPT_VERIFY:
+                opts->verify = 1;
+                break;
+            case OPT_JOURNAL:
+                opts->journal = optarg;
+                break;
+            case OPT_RESUME:
+                opts->resume = 1;
+                break;
+            case OPT_MANIFEST:
+                opts->manifest = optarg;
+                break;
+            case OPT_NOCACHE:
+                opts->nocache = 1;
+                break;
+            case OPT_DIRECT:
+                opts->direct_min = DIRECT_MIN;
+                if (optarg != NULL) {
+                    opts->direct_min = parse_size(optarg);
+                    if (opts->direct_min < 1) {
+                        print_error("invalid size \"%s\".", optarg);
+                        return -1;
+                    }
+                }
+                break;
+            case OPT_BUFFER: {
+                off_t size = parse_size(optarg);
+                if (size < 4096 || size > 1073741824) {
+                    print_error("invalid buffer size \"%s\".", optarg);
+                    return -1;
+                }
+                opts->buffer = size;
+                break;
+            }
             case 'k':
                 if (opts->force == 0) {
                     opts->keep = 1;
@@ -104,8 +293,51 @@ int parse_opts(opts_t *opts, int argc, char *argv[])
             case 'D':
                 opts->debug = 1;
                 break;
-            case '?':
-                if (isprint(optopt)) {
+            case OPT_REFLINK:
+                if (optarg == NULL || strcmp(optarg, "always") == 0) {
+                    opts->clone = CLONE_ALWAYS;
+                } else if (strcmp(optarg, "auto") == 0) {
+                    opts->clone = CLONE_AUTO;
+                } else if (strcmp(optarg, "never") == 0) {
+                    opts->clone = CLONE_NEVER;
+                } else {
+                    print_error("invalid reflink mode \"%s\".", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_URING:
+                opts->queue_depth = URING_DEPTH;
+                if (optarg != NULL) {
+                    char *end;
+                    long depth = strtol(optarg, &end, 10);
+                    if (*end != '\0' || depth < 1 || depth > 4096) {
+                        print_error("invalid queue depth \"%s\".", optarg);
+                        return -1;
+                    }
+                    opts->queue_depth = depth;
+                }
+                break;
+            case '?': {
+                /* known long option with missing or unexpected argument */
+                const struct option *opt = NULL;
+                if (optopt != 0 && strncmp(argv[optind - 1], "--", 2) == 0)
+                    opt = find_long_opt(optopt);
+                if (opt != NULL && opt->has_arg == required_argument) {
+                    print_error("option \"--%s\" requires an argument.",
+                                opt->name);
+                } else if (opt != NULL) {
+                    print_error("option \"--%s\" takes no argument.",
+                                opt->name);
+                } else if (optopt == 0) {
+                    print_error("unknown option \"%s\".\nTry -h for help.",
+                                argv[optind - 1]);
+                } else if (optopt < 0 || optopt >= 256) {
+                    print_error("invalid use of option \"%s\".",
+                                argv[optind - 1]);
+                } else if (optopt != ':' && strchr(SHORT_OPTS, optopt)) {
+                    print_error("option \"-%c\" requires an argument.",
+                                optopt);
+                } else if (isprint(optopt)) {
                     print_error("unknown option \"-%c\".\nTry -h for help.",
                                 optopt);
                 } else {
@@ -113,10 +345,29 @@ int parse_opts(opts_t *opts, int argc, char *argv[])
                     print_error("Try -h for help.");
                 }
                 return -1;
+            }
             default:
                 return -1;
         }
     }
 
+    /* duplicates are only known once the whole list is there */
+    if (opts->dedup != DEDUP_NONE && opts->stream) {
+        print_error("--dedup cannot be combined with --stream.");
+        return -1;
+    }
+    if (opts->resume && opts->journal == NULL) {
+        print_error("--resume requires --journal.");
+        return -1;
+    }
+    /* hashing needs all data in user space, in file order */
+    if ((opts->checksum != NULL || opts->verify) &&
+            (opts->sparse != SPARSE_NEVER || opts->streams > 1 ||
+             opts->clone == CLONE_ALWAYS)) {
+        print_error("--checksum and --verify cannot be combined with "
+                    "--sparse, --streams or --reflink=always.");
+        return -1;
+    }
+
     return optind;
 }
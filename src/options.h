@@ -19,11 +19,31 @@
 #ifndef _OPTIONS_H
 #define _OPTIONS_H
 
-#define BUFFS 1048576       /* 1MiB buffer for read() and write()       */
+#include <sys/types.h>                  // off_t
+
+#define BUFFS 1048576       /* default chunk for read()/write() (1MiB)  */
+#define BUFF_MIN 65536      /* bounds of chunk size tuning (64KiB ...   */
+#define BUFF_MAX 67108864   /* ... 64MiB)                               */
+#define TUNE_WINDOW 67108864 /* throughput sample for tuning (64MiB)    */
 #define BUFFM 10            /* buffer multiplier, see work_list()       */
 #define BAR_WIDTH 20        /* progress bar width (characters)          */
 #define MAX_SIZE_L 15       /* maximum length of size string, numbers   */
+#define URING_DEPTH 8       /* default io_uring queue depth             */
+#define SPLIT_MIN 268435456 /* split files from 256MiB on (--streams)   */
+#define RANGE_SIZE 67108864 /* 64MiB ranges for split files             */
+#define PIPE_DEPTH 4        /* buffers between reader and writer thread */
+#define DIRECT_MIN 1073741824 /* default O_DIRECT threshold (1GiB)      */
+#define STREAM_DEPTH 1024   /* items queued for workers (--stream)      */
+#define CACHE_WINDOW 33554432 /* read-ahead/drop-behind window (32MiB)  */
+#define DEDUP_BLOCK 4096    /* head and tail fingerprint size (--dedup) */
+#define DELTA_BLOCK 4096    /* unit of comparison and rewrite (--delta) */
+#define JOURNAL_SYNC 10     /* seconds between syncs (--journal)        */
+#define JOURNAL_COMMIT 268435456 /* partial file commits (256MiB)       */
 
+typedef enum { CLONE_NEVER, CLONE_AUTO, CLONE_ALWAYS } clone_t;
+typedef enum { SPARSE_NEVER, SPARSE_AUTO, SPARSE_ALWAYS } sparse_t;
+typedef enum { ORDER_PATH, ORDER_INODE, ORDER_EXTENT } order_t;
+typedef enum { DEDUP_NONE, DEDUP_LINK, DEDUP_REFLINK } dedup_t;
 
 typedef struct {
     unsigned int bars            : 1;
@@ -38,6 +58,25 @@ typedef struct {
     unsigned int pretend         : 1;
     unsigned int debug           : 1;
     unsigned int ignore_uid_err  : 1;
+    unsigned int pipeline        : 1;
+    unsigned int nocache         : 1;
+    unsigned int stream          : 1;
+    unsigned int delta           : 1;
+    unsigned int resume          : 1;
+    unsigned int verify          : 1;
+    clone_t      clone;
+    sparse_t     sparse;
+    order_t      order;
+    dedup_t      dedup;
+    unsigned int queue_depth;
+    unsigned int jobs;
+    unsigned int streams;
+    off_t        direct_min;
+    size_t       buffer;
+    unsigned int crawl_threads;
+    char         *manifest;             // file of destination state
+    char         *journal;              // file of finished items
+    char         *checksum;             // file of content hashes
 } opts_t;
 
 
@@ -0,0 +1,358 @@
+/* Copyright lynix <lynix47@gmail.com>, 2009, 2010, 2014
+ *
+ * This file is part of vcp (verbose cp).
+ *
+ * vcp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcp. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE         /* syscall()                                */
+
+#include "uring.h"
+#include "helpers.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* operation encoded in lowest bit of user_data */
+#define OP_READ     0
+#define OP_WRITE    1
+
+/* one buffer with the chunk it currently transfers */
+typedef struct {
+    unsigned int    job;
+    off_t           off;                /* start of pending range   */
+    off_t           end;                /* end of chunk             */
+    ssize_t         got;                /* result of last read      */
+} slot_t;
+
+struct uring {
+    int             fd;
+    unsigned int    depth;
+    size_t          buff_size;
+    char            fixed;              /* buffers are registered   */
+    char            *buffers;
+    slot_t          *slots;
+
+    /* submission queue */
+    void            *sq_ptr;
+    size_t          sq_len;
+    unsigned int    *sq_head;
+    unsigned int    *sq_tail;
+    unsigned int    *sq_mask;
+    unsigned int    *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t          sqes_len;
+    unsigned int    to_submit;
+
+    /* completion queue */
+    void            *cq_ptr;
+    size_t          cq_len;
+    unsigned int    *cq_head;
+    unsigned int    *cq_tail;
+    unsigned int    *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+
+static int sys_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned int submit, unsigned int complete,
+                     unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned int opcode, void *arg,
+                        unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+uring_t *uring_new(unsigned int depth, size_t buff_size)
+{
+    uring_t *ring = calloc(1, sizeof(uring_t));
+    if (ring == NULL)
+        return NULL;
+
+    ring->depth     = depth;
+    ring->buff_size = buff_size;
+    ring->sq_ptr    = MAP_FAILED;
+    ring->cq_ptr    = MAP_FAILED;
+    ring->sqes      = MAP_FAILED;
+
+    /* every buffer may have a linked read and write queued */
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = sys_setup(depth * 2, &params);
+    if (ring->fd < 0) {
+        print_debug("io_uring_setup() failed: %s", strerror(errno));
+        free(ring);
+        return NULL;
+    }
+
+    /* map rings, kernel may provide both in one mapping */
+    ring->sq_len = params.sq_off.array + params.sq_entries *
+                   sizeof(unsigned int);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries *
+                   sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto fail;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail;
+
+    char *sq = ring->sq_ptr;
+    ring->sq_head   = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail   = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask   = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array  = (unsigned int *)(sq + params.sq_off.array);
+    char *cq = ring->cq_ptr;
+    ring->cq_head   = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail   = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask   = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes      = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    /* allocate buffers, register them to save per-request page mapping */
+    ring->slots = calloc(depth, sizeof(slot_t));
+    if (ring->slots == NULL)
+        goto fail;
+    if (posix_memalign((void **)&ring->buffers, sysconf(_SC_PAGESIZE),
+                       depth * buff_size) != 0) {
+        ring->buffers = NULL;
+        goto fail;
+    }
+    struct iovec *iov = malloc(depth * sizeof(struct iovec));
+    if (iov == NULL)
+        goto fail;
+    for (unsigned int i = 0; i < depth; i++) {
+        iov[i].iov_base = ring->buffers + i * buff_size;
+        iov[i].iov_len  = buff_size;
+    }
+    if (sys_register(ring->fd, IORING_REGISTER_BUFFERS, iov, depth) == 0) {
+        ring->fixed = 1;
+    } else {
+        print_debug("failed to register io_uring buffers: %s",
+                    strerror(errno));
+        errno = 0;
+    }
+    free(iov);
+
+    return ring;
+
+fail:
+    print_debug("failed to set up io_uring: %s", strerror(errno));
+    uring_delete(ring);
+    return NULL;
+}
+
+void uring_delete(uring_t *ring)
+{
+    if (ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr != MAP_FAILED)
+        munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+
+    free(ring->buffers);
+    free(ring->slots);
+    free(ring);
+}
+
+/* queue read or write of given slot's pending range */
+static void queue_op(uring_t *ring, uring_job_t *jobs, unsigned int slot_i,
+                     int op, size_t len, char link)
+{
+    slot_t *slot = &ring->slots[slot_i];
+    unsigned int tail = *ring->sq_tail;
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    if (op == OP_READ) {
+        sqe->opcode = ring->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd     = jobs[slot->job].src;
+    } else {
+        sqe->opcode = ring->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd     = jobs[slot->job].dst;
+    }
+    sqe->flags      = link ? IOSQE_IO_LINK : 0;
+    sqe->off        = slot->off;
+    sqe->addr       = (unsigned long)(ring->buffers + slot_i * ring->buff_size);
+    sqe->len        = len;
+    sqe->buf_index  = slot_i;
+    sqe->user_data  = ((unsigned long)slot_i << 1) | op;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+/* queue write of pending range, linked to the read filling the buffer */
+static void queue_pair(uring_t *ring, uring_job_t *jobs, unsigned int slot_i)
+{
+    slot_t *slot = &ring->slots[slot_i];
+    size_t len = slot->end - slot->off;
+
+    queue_op(ring, jobs, slot_i, OP_READ, len, 1);
+    queue_op(ring, jobs, slot_i, OP_WRITE, len, 0);
+}
+
+static void job_fail(uring_job_t *job, int error, char dst)
+{
+    if (job->error != 0)
+        return;
+
+    job->error      = error;
+    job->error_dst  = dst;
+}
+
+int uring_copy(uring_t *ring, uring_job_t *jobs, unsigned int count,
+               uring_cb_t advance)
+{
+    unsigned int next_job = 0, busy = 0, failed = 0;
+    off_t next_off = 0;
+    unsigned int *free_slots = malloc(ring->depth * sizeof(unsigned int));
+    unsigned int n_free = ring->depth;
+
+    if (free_slots == NULL) {
+        for (unsigned int i = 0; i < count; i++)
+            job_fail(&jobs[i], ENOMEM, 0);
+        return count;
+    }
+    for (unsigned int i = 0; i < ring->depth; i++)
+        free_slots[i] = i;
+    for (unsigned int i = 0; i < count; i++)
+        jobs[i].error = 0;
+
+    while (1) {
+        /* hand out chunks to idle buffers, batched across all jobs */
+        while (n_free > 0 && next_job < count) {
+            uring_job_t *job = &jobs[next_job];
+            if (next_off >= job->size || job->error != 0) {
+                next_job++;
+                next_off = 0;
+                continue;
+            }
+            unsigned int slot_i = free_slots[--n_free];
+            slot_t *slot = &ring->slots[slot_i];
+            slot->job = next_job;
+            slot->off = next_off;
+            slot->end = next_off + ring->buff_size;
+            if (slot->end > job->size)
+                slot->end = job->size;
+            next_off = slot->end;
+            queue_pair(ring, jobs, slot_i);
+            busy++;
+        }
+
+        if (busy == 0)
+            break;
+
+        /* submit everything queued, wait for at least one completion */
+        int ret = sys_enter(ring->fd, ring->to_submit, 1,
+                            IORING_ENTER_GETEVENTS);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            /* ring is unusable, requests still in flight are lost */
+            for (unsigned int i = 0; i < count; i++)
+                job_fail(&jobs[i], errno, 0);
+            free(free_slots);
+            return count;
+        }
+        ring->to_submit -= ret;
+
+        /* reap completions */
+        unsigned int head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            unsigned int slot_i = cqe->user_data >> 1;
+            int op = cqe->user_data & 1;
+            int res = cqe->res;
+            slot_t *slot = &ring->slots[slot_i];
+            uring_job_t *job = &jobs[slot->job];
+            head++;
+
+            if (op == OP_READ) {
+                /* a short read breaks the link, write gets cancelled */
+                slot->got = res;
+                if (res < 0)
+                    job_fail(job, -res, 0);
+                else if (res == 0)
+                    job_fail(job, ENODATA, 0);
+                continue;
+            }
+
+            if (res == -ECANCELED && slot->got > 0 && job->error == 0) {
+                /* short read: flush what we got, re-read rest afterwards */
+                queue_op(ring, jobs, slot_i, OP_WRITE, slot->got, 0);
+                continue;
+            }
+            if (res < 0 && res != -ECANCELED)
+                job_fail(job, -res, 1);
+            else if (res == 0)
+                job_fail(job, EIO, 1);
+            if (res > 0 && job->error == 0) {
+                slot->off += res;
+                advance(job, res);
+                if (slot->off < slot->end) {
+                    queue_pair(ring, jobs, slot_i);
+                    continue;
+                }
+            }
+
+            /* chunk done or job failed, release buffer */
+            free_slots[n_free++] = slot_i;
+            busy--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    free(free_slots);
+
+    for (unsigned int i = 0; i < count; i++)
+        if (jobs[i].error != 0)
+            failed++;
+
+    return failed;
+}
@@ -0,0 +1,51 @@
+/* Copyright lynix <lynix47@gmail.com>, 2009, 2010, 2014
+ *
+ * This file is part of vcp (verbose cp).
+ *
+ * vcp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcp. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <sys/types.h>
+
+typedef struct uring uring_t;
+
+typedef struct {
+    int     src;
+    int     dst;
+    off_t   size;
+    int     error;                      // errno of first failure, or 0
+    char    error_dst;                  // failure occured while writing
+    void    *data;                      // passed through to progress callback
+} uring_job_t;
+
+// called for every completed write with the number of bytes written
+typedef void (*uring_cb_t)(uring_job_t *job, size_t bytes);
+
+
+// set up ring with given queue depth and per-request buffer size,
+// returns NULL if io_uring is not available
+uring_t *uring_new(unsigned int depth, size_t buff_size);
+
+// tear down given ring, release buffers
+void    uring_delete(uring_t *ring);
+
+// copy given jobs concurrently, keeping up to 'depth' chunks in flight,
+// returns number of failed jobs (see error fields)
+int     uring_copy(uring_t *ring, uring_job_t *jobs, unsigned int count,
+                   uring_cb_t advance);
+
+#endif
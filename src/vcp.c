@@ -16,7 +16,7 @@
  * along with vcp. If not, see <http://www.gnu.org/licenses/>.
  */
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 600
 
 #include <stdio.h>
 #include <time.h>           /* clock_gettime() */
@@ -38,14 +38,60 @@
 #include "helpers.h"        /* little helper functions                  */
 #include "options.h"        /* global options, options struct           */
 #include "copy.h"
+#include "crawl.h"
+#include "dedup.h"
+#include "manifest.h"
+#include "journal.h"
+
+/* per-thread I/O resources */
+typedef struct {
+    buffer_t    buffer;
+    file_t      **batch;
+    uring_t     *ring;
+} worker_t;
+
+/* copy list shared by parallel workers */
+typedef struct {
+    flist_t         *list;
+    strlist_t       *fail_list;
+    ulong           next;
+    char            use_ring;
+    pthread_mutex_t lock;
+} pool_t;
+
+/* bounded queue between crawler and workers in streaming mode */
+typedef struct {
+    file_t          *items[STREAM_DEPTH];
+    ulong           head;
+    ulong           count;
+    char            closed;
+    char            use_ring;
+    pthread_mutex_t lock;
+    pthread_cond_t  filled;
+    pthread_cond_t  drained;
+    flist_t         *list;              /* all items, for final pass */
+    flist_t         *asks;              /* items waiting for prompt  */
+    strlist_t       *fail_list;
+} stream_t;
+
+/* streaming worker thread, resources are set up by the main thread */
+typedef struct {
+    stream_t    *stream;
+    worker_t    worker;
+    pthread_t   tid;
+} stream_worker_t;
 
 /* globals */
 opts_t          opts;
+pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* functions */
 flist_t *build_list(int argc, int start, char *argv[]);
 int     work_list(flist_t *list);
-int     crawl(flist_t *file_list, char *src, char *dst);
+int     stream_list(int argc, int start, char *argv[]);
+static void save_manifest(flist_t *list);
+static void close_journal(flist_t *list, char finished);
+static void save_checksums(flist_t *list);
 
 
 int main(int argc, char *argv[])
@@ -69,6 +115,9 @@ int main(int argc, char *argv[])
         puts("Collecting file information...");
         fflush(stdout);
     }
+    if (opts.stream && !opts.pretend)
+        exit(stream_list(argc, argstart, argv) == 0 ? EXIT_SUCCESS :
+             EXIT_FAILURE);
     flist_t *copy_list = build_list(argc, argstart, argv);
     if (copy_list == NULL) {
         print_error("failed to build file list, aborting.");
@@ -77,6 +126,10 @@ int main(int argc, char *argv[])
     /* check if something left to copy at all */
     if (copy_list->count == 0) {
         printf("vcp: no items to copy.\n");
+        if (!opts.pretend) {
+            save_manifest(copy_list);
+            close_journal(copy_list, 1);
+        }
         flist_delete(copy_list);
         exit(EXIT_SUCCESS);
     }
@@ -99,7 +152,145 @@ int main(int argc, char *argv[])
     exit(EXIT_SUCCESS);
 }
 
-flist_t *build_list(int argc, int start, char *argv[])
+/* hand crawled item to the workers, create directories right away */
+static int stream_emit(file_t *item, void *arg)
+{
+    stream_t *stream = (stream_t *)arg;
+
+    /* list keeps items for the final pass, total size grows with it */
+    pthread_mutex_lock(&list_lock);
+    int ret = flist_add(stream->list, item);
+    pthread_mutex_unlock(&list_lock);
+    if (ret != 0)
+        return -1;
+
+    /* hardlinks are made once everything else is copied */
+    if (item->link != NULL)
+        return 0;
+
+    if (item->type == RDIR) {
+        char path[PATH_MAX];
+        if (opts.verbose)
+            printf("%s\n", f_src_path(item, path));
+        if (copy_dir(item, &opts, stream->fail_list) == 0)
+            item->done = 1;
+        return 0;
+    }
+
+    pthread_mutex_lock(&stream->lock);
+    while (stream->count == STREAM_DEPTH && !stream->closed)
+        pthread_cond_wait(&stream->drained, &stream->lock);
+    stream->items[(stream->head + stream->count) % STREAM_DEPTH] = item;
+    stream->count++;
+    pthread_cond_signal(&stream->filled);
+    pthread_mutex_unlock(&stream->lock);
+
+    return 0;
+}
+
+/* attach destination state of the last run to given list (--manifest) */
+static int load_manifest(flist_t *list)
+{
+    if (opts.manifest == NULL)
+        return 0;
+
+    list->manifest = manifest_load(opts.manifest);
+    if (list->manifest == NULL) {
+        print_error("out of memory while loading manifest");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* record destination state for the next run (--manifest) */
+static void save_manifest(flist_t *list)
+{
+    if (list->manifest != NULL &&
+            manifest_save(list->manifest, list, opts.manifest) != 0)
+        print_error("failed to write manifest '%s': %s", opts.manifest,
+                    strerror(errno));
+}
+
+/* start journal of finished items, or continue the one of an interrupted
+ * run (--journal, --resume) */
+static int open_journal(flist_t *list)
+{
+    if (opts.journal == NULL || (opts.pretend && !opts.resume))
+        return 0;
+
+    /* pretend mode only looks at what is left to do */
+    list->journal = journal_open(opts.journal, opts.resume, opts.pretend);
+    if (list->journal == NULL) {
+        print_error("failed to open journal '%s': %s", opts.journal,
+                    strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the journal is of no use any more once everything has been copied */
+static void close_journal(flist_t *list, char finished)
+{
+    if (list->journal == NULL)
+        return;
+
+    if (journal_close(list->journal, finished) != 0)
+        print_error("failed to write journal '%s': %s", opts.journal,
+                    strerror(errno));
+    list->journal = NULL;
+}
+
+/* record finished items for an interrupted run (--journal); directories
+ * are left out, their attributes are only set at the very end */
+static void journal_items(flist_t *list, file_t **items, unsigned int n)
+{
+    char path[PATH_MAX];
+
+    if (list->journal == NULL)
+        return;
+    for (unsigned int k = 0; k < n; k++)
+        if (items[k]->done == 1 && items[k]->type != RDIR)
+            journal_done(list->journal, f_dst_path(items[k], path),
+                         items[k]);
+}
+
+/* write checksums of the files copied in given list, in the format of
+ * xxh64sum (--checksum) */
+static void save_checksums(flist_t *list)
+{
+    if (opts.checksum == NULL)
+        return;
+
+    /* others may read the checksums, not change them (umask is 0) */
+    int fd = open(opts.checksum, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    FILE *file = (fd >= 0) ? fdopen(fd, "w") : NULL;
+    if (file == NULL) {
+        int err = errno;
+        if (fd >= 0)
+            close(fd);
+        errno = err;
+        print_error("failed to write checksums to '%s': %s", opts.checksum,
+                    strerror(errno));
+        return;
+    }
+    char path[PATH_MAX];
+    for (ulong i = 0; i < list->count; i++) {
+        file_t *item = list->items[i];
+        if (item->type == RFILE && item->done == 1)
+            fprintf(file, "%016llx  %s\n", (unsigned long long)item->sum,
+                    f_dst_path(item, path));
+    }
+    if (fclose(file) != 0)
+        print_error("failed to write checksums to '%s': %s", opts.checksum,
+                    strerror(errno));
+}
+
+/* check arguments, crawl source items into given list or, in streaming
+ * mode, pass them on to the workers right away */
+static int crawl_args(flist_t *file_list, int argc, int start, char *argv[],
+                      stream_t *stream)
 {
     /* clean destination path */
     char *dest = clean_path(argv[argc - 1]);
@@ -111,23 +302,18 @@ flist_t *build_list(int argc, int start, char *argv[])
     if (stat(dest, &dest_stat) == 0) {
         if (!S_ISDIR(dest_stat.st_mode) && num_src > 1) {
             print_error("unable to copy multiple items to one file");
-            return NULL;
+            free(dest);
+            return -1;
         }
     } else {
         errno = 0;
         if (num_src > 1) {
             print_error("destination directory '%s' does not exist", dest);
-            return NULL;
+            free(dest);
+            return -1;
         }
     }
 
-    /* create copy list */
-    flist_t *file_list = flist_new();
-    if (file_list == NULL) {
-        print_debug("failed to create copy list");
-        return NULL;
-    }
-
     /* iterate over command line and crawl items, recursively */
     for (int i = start; i < start + num_src; i++) {
         char *src = argv[i];
@@ -135,146 +321,227 @@ flist_t *build_list(int argc, int start, char *argv[])
         if (S_ISDIR(dest_stat.st_mode))
             new_dest = path_str(new_dest, path_base(src));
 
-        if (crawl(file_list, src, new_dest) != 0) {
-            flist_delete(file_list);
-            free(dest);
-            return NULL;
-        }
+        int ret = (stream != NULL) ?
+                  crawl_stream(stream->list, src, new_dest, &opts,
+                               stream_emit, stream, stream->asks) :
+                  crawl(file_list, src, new_dest, &opts);
 
         if (S_ISDIR(dest_stat.st_mode))
             free(new_dest);
+        if (ret != 0) {
+            free(dest);
+            return -1;
+        }
     }
 
-    /* shrink and sort list by destination */
+    free(dest);
+
+    return 0;
+}
+
+flist_t *build_list(int argc, int start, char *argv[])
+{
+    /* create copy list */
+    flist_t *file_list = flist_new();
+    if (file_list == NULL) {
+        print_debug("failed to create copy list");
+        return NULL;
+    }
+
+    if (load_manifest(file_list) != 0 || open_journal(file_list) != 0 ||
+            crawl_args(file_list, argc, start, argv, NULL) != 0) {
+        flist_delete(file_list);
+        return NULL;
+    }
+
+    /* shrink and sort list by destination, hardlinks are linked to the
+     * first one in tree order */
     flist_shrink(file_list);
     if (file_list->count > 0)
         flist_sort(file_list);
+    flist_link_all(file_list);
 
-    free(dest);
+    /* duplicates are linked to the first one in list order */
+    if (opts.dedup != DEDUP_NONE && dedup_list(file_list, opts.dedup) < 0)
+        print_error("out of memory while looking for duplicates");
 
     return file_list;
 }
 
-int crawl(flist_t *file_list, char *src, char *dst)
+/* gather item i and following small files into one io_uring batch,
+ * returns index of last item consumed */
+static ulong collect_batch(flist_t *list, ulong i, file_t **batch,
+                           unsigned int *n)
 {
-    /* check source access, prepare file struct */
-    file_t *f_src = f_new(src, dst);
-    if (f_src == NULL) {
-        print_error("failed to open '%s': %s", src, strerror(errno));
-        return -1;
+    file_t *item = list->items[i];
+
+    *n = 0;
+    batch[(*n)++] = item;
+    if (item->type != RFILE || opts.queue_depth == 0 ||
+            COPY_SPECIAL(item, &opts))
+        return i;
+
+    /* large files go alone to get progress output, hardlinks are left
+     * for work_links() */
+    while (item->size <= BUFFS && *n < opts.queue_depth &&
+            i + 1 < list->count) {
+        file_t *next = list->items[i + 1];
+        char skip = next->done || next->link != NULL;
+        if (!skip && (next->type != RFILE || next->size > BUFFS ||
+                      COPY_SPECIAL(next, &opts)))
+            break;
+        i++;
+        if (!skip)
+            batch[(*n)++] = next;
     }
 
-    /* collision handling */
-    if (access(dst, F_OK) == 0) {
-        file_t *f_dst = f_new(dst, dst);
-        if (f_dst == NULL) {
-            print_error("failed to read '%s': %s", dst, strerror(errno));
-            f_delete(f_src);
-            f_delete(f_dst);
-            return -1;
-        }
+    return i;
+}
 
-        if ((f_src->type == RDIR) != (f_dst->type == RDIR)) {
-            print_error("type mismatch while trying to replace file with directory or vice versa: '%s', '%s'",
-                        src, dst);
-            f_delete(f_src);
-            f_delete(f_dst);
-            return -1;
-        }
+static int worker_init(worker_t *worker, char use_ring)
+{
+    worker->ring    = NULL;
+    worker->batch   = malloc((opts.queue_depth + 1) * sizeof(file_t *));
+
+    /* grown on demand, O_DIRECT requires page-aligned buffers; it is used
+     * for reading back as well */
+    worker->buffer.data     = NULL;
+    worker->buffer.size     = 0;
+    worker->buffer.aligned  = opts.direct_min > 0 || opts.verify;
+    if (buffer_reserve(&worker->buffer, BUFF_MIN) != 0 ||
+            worker->batch == NULL) {
+        free(worker->buffer.data);
+        free(worker->batch);
+        return -1;
+    }
 
-        if (opts.keep || (opts.update && f_equal(f_src, f_dst)))
-            f_src->done = 1;
-        else if (!opts.force && !ask_overwrite(f_dst, f_src))
-            f_src->done = 1;
+    /* set up asynchronous I/O if requested */
+    if (use_ring)
+        worker->ring = uring_new(opts.queue_depth,
+                                 opts.buffer > 0 ? opts.buffer : BUFFS);
 
-        f_delete(f_dst);
-    }
+    return 0;
+}
 
-    /* add to copy list */
-    if (!f_src->done && (flist_add(file_list, f_src) != 0)) {
-        print_error("unable to add to copy list");
-        f_delete(f_src);
-        return -1;
+static void worker_free(worker_t *worker)
+{
+    free(worker->buffer.data);
+    free(worker->batch);
+    if (worker->ring != NULL)
+        uring_delete(worker->ring);
+}
+
+/* copy a single item or a batch of regular files */
+static void work_items(worker_t *worker, file_t **items, unsigned int n,
+                       flist_t *list, strlist_t *fail_list)
+{
+    file_t *item = items[0];
+    char path[PATH_MAX];
+
+    if (opts.verbose)
+        for (unsigned int k = 0; k < n; k++)
+            printf("%s\n", f_src_path(items[k], path));
+
+    if (item->type == RDIR) {
+        if (copy_dir(item, &opts, fail_list) == 0)
+            item->done = 1;
+    } else if (item->type == SLINK) {
+        if (copy_link(item, fail_list) == 0)
+            item->done = 1;
+    } else if (worker->ring != NULL && !COPY_SPECIAL(item, &opts)) {
+        copy_batch(items, n, list, fail_list, &opts, worker->ring);
+    } else if (copy_file(item, list, fail_list, &opts,
+                         &worker->buffer) == 0) {
+        item->done = 1;
     }
 
-    /* advance to recursion only if src is a directory */
-    if (f_src->type != RDIR)
-        return 0;
+    /* account finished transfers */
+    pthread_mutex_lock(&list_lock);
+    for (unsigned int k = 0; k < n; k++)
+        if (items[k]->type == RFILE && items[k]->done)
+            list->bytes_done += items[k]->xfer;
+    pthread_mutex_unlock(&list_lock);
 
-    DIR *src_dir = opendir(src);
-    if (src_dir == NULL) {
-        print_error("failed to open directory '%s': %s", src, strerror(errno));
-        return -1;
-    }
-    struct dirent *src_dirp;
-    while ((src_dirp = readdir(src_dir)) != NULL) {
-        /* IMPORTANT: skip '.' and '..' */
-        char *n = src_dirp->d_name;
-        if (n[0] == '.' && (n[1] == '\0' || (n[1] == '.' && n[2] == '\0')))
-            continue;
+    journal_items(list, items, n);
+}
 
-        /* recursively crawl directory contents */
-        char *sub_src = path_str(src, src_dirp->d_name);
-        char *sub_dst = path_str(dst, src_dirp->d_name);
-        if (crawl(file_list, sub_src, sub_dst) != 0) {
-            free(sub_src);
-            free(sub_dst);
-            closedir(src_dir);
-            return -1;
+/* take items from shared list until it is worked off */
+static void work_pool(pool_t *pool, worker_t *worker)
+{
+    flist_t *list = pool->list;
+    unsigned int n;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->next < list->count &&
+               (list->items[pool->next]->done ||
+                list->items[pool->next]->link != NULL))
+            pool->next++;
+        if (pool->next >= list->count) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
         }
-        free(sub_src);
-        free(sub_dst);
-    }
-    closedir(src_dir);
+        pool->next = collect_batch(list, pool->next, worker->batch, &n) + 1;
+        pthread_mutex_unlock(&pool->lock);
 
-    return 0;
+        work_items(worker, worker->batch, n, list, pool->fail_list);
+    }
 }
 
-int work_list(flist_t *list)
+static void *work_thread(void *arg)
 {
-    /* initialize fail-list */
-    strlist_t *fail_list = strlist_new();
-    if (fail_list == NULL) {
-        print_error("failed to create fail_list");
-        return -1;
-    }
+    pool_t *pool = (pool_t *)arg;
+    worker_t worker;
 
-    /* allocate I/O buffer */
-    char *buffer = malloc(BUFFS);
-    if (buffer == NULL) {
-        print_error("failed to allocate I/O buffer");
-        strlist_delete(fail_list);
-        return -1;
+    if (worker_init(&worker, pool->use_ring) != 0) {
+        print_error("failed to allocate I/O buffer for worker thread");
+        return NULL;
     }
+    work_pool(pool, &worker);
+    worker_free(&worker);
 
-    /* work off the list */
+    return NULL;
+}
+
+/* recreate hardlinks and duplicates (--dedup) from items copied before,
+ * copy the data where this is not possible (e.g. first item failed,
+ * filesystem without hardlinks) */
+static void work_links(worker_t *worker, flist_t *list, strlist_t *fail_list)
+{
     for (ulong i = 0; i < list->count; i++) {
         file_t *item = list->items[i];
-
-        /* skip processed items */
-        if (item->done == 1)
+        if (item->link == NULL || item->done)
             continue;
 
-        if (opts.verbose)
-            printf("%s\n", item->src);
-
-        if (item->type == RDIR) {
-            if (copy_dir(item, &opts, fail_list) == 0)
-                item->done = 1;
-        } else if (item->type == SLINK) {
-            if (copy_link(item, fail_list) == 0)
-                item->done = 1;
-        } else if (item->type == RFILE) {
-            if (copy_file(item, list, fail_list, &opts, buffer, BUFFS) == 0) {
-                item->done = 1;
-                list->bytes_done += item->size;
+        int ret = -1;
+        if (item->link->done == 1 && (opts.dedup != DEDUP_REFLINK ||
+                                      F_SAME_INODE(item, item->link)))
+            ret = copy_hardlink(item);
+        else if (item->link->done == 1)
+            ret = copy_reflink(item, &opts, fail_list);
+        if (ret >= 0) {
+            if (opts.verbose) {
+                char path[PATH_MAX];
+                printf("%s\n", f_src_path(item, path));
             }
+            item->done = ret == 0;
+            item->sum = item->link->sum;
+            journal_items(list, &item, 1);
+            continue;
         }
+        print_debug("failed to link '%s', copying it", item->fname);
+        pthread_mutex_lock(&list_lock);
+        item->xfer = item->link->xfer;
+        list->size += item->xfer;
+        pthread_mutex_unlock(&list_lock);
+        work_items(worker, &item, 1, list, fail_list);
     }
+}
 
-    /* clear I/O buffer */
-    free(buffer);
-
+/* re-iterate list: update directory attributes, delete items if requested,
+ * report failures; frees given fail-list */
+static int finish_list(flist_t *list, strlist_t *fail_list)
+{
     /* re-iterate: update directory attributes, delete items if requested */
     for (ulong i = list->count - 1; i < list->count; i--) {
         file_t *item = list->items[i];
@@ -284,16 +551,18 @@ int work_list(flist_t *list)
             continue;
         }
 
+        char path[PATH_MAX];
         if (item->type == RDIR) {
             if (f_clone_attrs(item) != 0 && !opts.ignore_uid_err) {
-                fail_append(fail_list, item->dst, "unable to set attributes");
+                fail_append(fail_list, f_dst_path(item, path),
+                            "unable to set attributes");
                 item->done = 0;
                 continue;
             }
         }
 
-        if (opts.delete && (remove(item->src) != 0)) {
-            fail_append(fail_list, item->src, "failed to delete");
+        if (opts.delete && (remove(f_src_path(item, path)) != 0)) {
+            fail_append(fail_list, path, "failed to delete");
             item->done = 0;
         }
     }
@@ -312,3 +581,253 @@ int work_list(flist_t *list)
 
     return 0;
 }
+
+int work_list(flist_t *list)
+{
+    /* initialize fail-list */
+    strlist_t *fail_list = strlist_new();
+    if (fail_list == NULL) {
+        print_error("failed to create fail_list");
+        return -1;
+    }
+
+    /* allocate I/O buffer */
+    worker_t worker;
+    if (worker_init(&worker, opts.queue_depth > 0) != 0) {
+        print_error("failed to allocate I/O buffer");
+        strlist_delete(fail_list);
+        return -1;
+    }
+    if (opts.queue_depth > 0 && worker.ring == NULL)
+        print_error("io_uring unavailable, using synchronous I/O");
+
+    /* follow the source layout on disk, directories are still first */
+    if (flist_order(list, opts.order) != 0)
+        print_error("failed to reorder copy list, using path order");
+
+    if (opts.jobs > 1) {
+        /* create directories first, so workers need not care about order */
+        for (ulong i = 0; i < list->count; i++) {
+            file_t *item = list->items[i];
+            if (item->type == RDIR && !item->done)
+                work_items(&worker, &item, 1, list, fail_list);
+        }
+
+        /* spawn workers, main thread takes part as well */
+        pool_t pool;
+        pool.list       = list;
+        pool.fail_list  = fail_list;
+        pool.next       = 0;
+        pool.use_ring   = worker.ring != NULL;
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_t *threads = malloc((opts.jobs - 1) * sizeof(pthread_t));
+        unsigned int n_threads = 0;
+        progress_begin(list, &opts);
+        while (threads != NULL && n_threads < opts.jobs - 1) {
+            if (pthread_create(&threads[n_threads], NULL, work_thread,
+                               &pool) != 0) {
+                print_error("failed to spawn worker thread");
+                break;
+            }
+            n_threads++;
+        }
+        work_pool(&pool, &worker);
+        for (unsigned int i = 0; i < n_threads; i++)
+            pthread_join(threads[i], NULL);
+        progress_end();
+        free(threads);
+        pthread_mutex_destroy(&pool.lock);
+    } else {
+        /* work off the list */
+        unsigned int n;
+        for (ulong i = 0; i < list->count; i++) {
+            /* skip processed items and hardlinks */
+            if (list->items[i]->done == 1 || list->items[i]->link != NULL)
+                continue;
+
+            i = collect_batch(list, i, worker.batch, &n);
+            work_items(&worker, worker.batch, n, list, fail_list);
+        }
+    }
+
+    work_links(&worker, list, fail_list);
+
+    /* clear I/O buffer */
+    worker_free(&worker);
+
+    /* final pass expects directories before their contents */
+    if (opts.order != ORDER_PATH)
+        flist_sort(list);
+    save_checksums(list);
+    int ret = finish_list(list, fail_list);
+    save_manifest(list);
+    close_journal(list, ret == 0);
+
+    return ret;
+}
+
+/* small regular files may share an io_uring batch */
+static int stream_batchable(file_t *item)
+{
+    return item->type == RFILE && item->size <= BUFFS &&
+           !COPY_SPECIAL(item, &opts);
+}
+
+/* wait for next item, take following small files along for io_uring,
+ * returns number of items taken, 0 once the queue is closed and empty */
+static unsigned int stream_take(stream_t *stream, file_t **batch)
+{
+    unsigned int n = 0;
+
+    pthread_mutex_lock(&stream->lock);
+    while (stream->count == 0 && !stream->closed)
+        pthread_cond_wait(&stream->filled, &stream->lock);
+    while (stream->count > 0) {
+        file_t *item = stream->items[stream->head];
+        if (n > 0 && (n >= opts.queue_depth || !stream_batchable(batch[0]) ||
+                      !stream_batchable(item)))
+            break;
+        batch[n++] = item;
+        stream->head = (stream->head + 1) % STREAM_DEPTH;
+        stream->count--;
+    }
+    pthread_cond_broadcast(&stream->drained);
+    pthread_mutex_unlock(&stream->lock);
+
+    return n;
+}
+
+static void *stream_thread(void *arg)
+{
+    stream_worker_t *w = (stream_worker_t *)arg;
+    unsigned int n;
+
+    while ((n = stream_take(w->stream, w->worker.batch)) > 0)
+        work_items(&w->worker, w->worker.batch, n, w->stream->list,
+                   w->stream->fail_list);
+
+    return NULL;
+}
+
+/* copy items while the crawl is still going on: crawler threads hand them
+ * to the workers through a bounded queue, directories are created by the
+ * crawler before their contents are queued */
+int stream_list(int argc, int start, char *argv[])
+{
+    stream_t stream;
+    stream.head         = 0;
+    stream.count        = 0;
+    stream.closed       = 0;
+    stream.use_ring     = opts.queue_depth > 0;
+    stream.list         = flist_new();
+    stream.asks         = flist_new();
+    stream.fail_list    = strlist_new();
+    stream_worker_t *workers = calloc(opts.jobs, sizeof(stream_worker_t));
+    if (stream.list == NULL || stream.asks == NULL ||
+            stream.fail_list == NULL || workers == NULL) {
+        print_error("failed to create copy list");
+        if (stream.list != NULL)
+            flist_delete(stream.list);
+        if (stream.asks != NULL)
+            flist_delete(stream.asks);
+        if (stream.fail_list != NULL)
+            strlist_delete(stream.fail_list);
+        free(workers);
+        return -1;
+    }
+    stream.list->hardlinks = 1;
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.filled, NULL);
+    pthread_cond_init(&stream.drained, NULL);
+
+    /* workers must be running before the crawler may block on them */
+    unsigned int n_workers = 0;
+    progress_begin(stream.list, &opts);
+    while (n_workers < opts.jobs) {
+        stream_worker_t *w = &workers[n_workers];
+        w->stream = &stream;
+        if (worker_init(&w->worker, stream.use_ring) != 0) {
+            print_error("failed to allocate I/O buffer for worker thread");
+            break;
+        }
+        if (pthread_create(&w->tid, NULL, stream_thread, w) != 0) {
+            print_error("failed to spawn worker thread");
+            worker_free(&w->worker);
+            break;
+        }
+        n_workers++;
+    }
+    if (stream.use_ring && n_workers > 0 && workers[0].worker.ring == NULL)
+        print_error("io_uring unavailable, using synchronous I/O");
+
+    int ret = -1;
+    if (n_workers > 0 && load_manifest(stream.list) == 0 &&
+            open_journal(stream.list) == 0)
+        ret = crawl_args(NULL, argc, start, argv, &stream);
+
+    /* let workers finish, drop what is left if crawling failed */
+    pthread_mutex_lock(&stream.lock);
+    stream.closed = 1;
+    if (ret != 0)
+        stream.count = 0;
+    pthread_cond_broadcast(&stream.filled);
+    pthread_mutex_unlock(&stream.lock);
+    for (unsigned int i = 0; i < n_workers; i++)
+        pthread_join(workers[i].tid, NULL);
+    progress_end();
+    if (ret != 0)
+        print_error("failed to build file list, aborting.");
+
+    /* deferred prompts, now that output is quiet again */
+    if (ret == 0 && n_workers > 0 && stream.asks->count > 0) {
+        flist_t *confirmed = flist_new();
+        if (confirmed == NULL || crawl_asks(confirmed, stream.asks) != 0) {
+            print_error("failed to process overwrite prompts");
+            ret = -1;
+        }
+        for (ulong i = 0; confirmed != NULL && i < confirmed->count; i++) {
+            file_t *item = confirmed->items[i];
+            if (flist_add(stream.list, item) != 0) {
+                print_error("unable to add to copy list");
+                f_delete(item);
+                ret = -1;
+                continue;
+            }
+            if (item->link == NULL)
+                work_items(&workers[0].worker, &item, 1, stream.list,
+                           stream.fail_list);
+        }
+        if (confirmed != NULL) {
+            confirmed->count = 0;
+            flist_delete(confirmed);
+        }
+    }
+    if (ret == 0 && n_workers > 0)
+        work_links(&workers[0].worker, stream.list, stream.fail_list);
+    for (unsigned int i = 0; i < n_workers; i++)
+        worker_free(&workers[i].worker);
+    free(workers);
+    pthread_mutex_destroy(&stream.lock);
+    pthread_cond_destroy(&stream.filled);
+    pthread_cond_destroy(&stream.drained);
+    flist_delete(stream.asks);
+
+    if (ret == 0 && stream.list->count == 0)
+        printf("vcp: no items to copy.\n");
+
+    /* final pass expects directories before their contents */
+    flist_t *list = stream.list;
+    if (list->count > 0) {
+        flist_shrink(list);
+        flist_sort(list);
+    }
+    save_checksums(list);
+    if (finish_list(list, stream.fail_list) != 0)
+        ret = -1;
+    /* records of failed items are not confirmed, see manifest_save() */
+    save_manifest(list);
+    close_journal(list, ret == 0);
+    flist_delete(list);
+
+    return ret;
+}
@@ -0,0 +1,120 @@
+/* Copyright lynix <lynix47@gmail.com>, 2009, 2010, 2014
+ *
+ * This file is part of vcp (verbose cp).
+ *
+ * vcp is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * vcp is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with vcp. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "zero.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ZERO_X86
+#include <immintrin.h>
+#endif
+
+
+/* portable fallback: compare word-wise */
+static int zero_scalar(const char *block, size_t len)
+{
+    uint64_t acc = 0, word;
+    size_t i = 0;
+
+    for (; i + 4 * sizeof(word) <= len; i += 4 * sizeof(word)) {
+        for (int k = 0; k < 4; k++) {
+            memcpy(&word, block + i + k * sizeof(word), sizeof(word));
+            acc |= word;
+        }
+        if (acc != 0)
+            return 0;
+    }
+    for (; i < len; i++)
+        if (block[i] != 0)
+            return 0;
+
+    return 1;
+}
+
+#ifdef ZERO_X86
+__attribute__((target("sse2")))
+static int zero_sse2(const char *block, size_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m128i acc = _mm_loadu_si128((const __m128i *)(block + i));
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(block + i +
+                                                 16)));
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(block + i +
+                                                 32)));
+        acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(block + i +
+                                                 48)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF)
+            return 0;
+    }
+
+    return zero_scalar(block + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int zero_avx2(const char *block, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 128 <= len; i += 128) {
+        __m256i acc = _mm256_loadu_si256((const __m256i *)(block + i));
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *)
+                              (block + i + 32)));
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *)
+                              (block + i + 64)));
+        acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i *)
+                              (block + i + 96)));
+        if (!_mm256_testz_si256(acc, acc))
+            return 0;
+    }
+
+    return zero_scalar(block + i, len - i);
+}
+#endif
+
+/* pick implementation on first call */
+static int zero_dispatch(const char *block, size_t len);
+
+static int (*zero_impl)(const char *, size_t) = zero_dispatch;
+
+static int zero_dispatch(const char *block, size_t len)
+{
+    int (*impl)(const char *, size_t) = zero_scalar;
+
+#ifdef ZERO_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        impl = zero_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        impl = zero_sse2;
+#endif
+
+    /* concurrent first calls all store the same value */
+    __atomic_store_n(&zero_impl, impl, __ATOMIC_RELAXED);
+
+    return impl(block, len);
+}
+
+int zero_block(const char *block, size_t len)
+{
+    return __atomic_load_n(&zero_impl, __ATOMIC_RELAXED)(block, len);
+}